@@ -0,0 +1,80 @@
+//
+// Discrete distribution with O(1) sampling (Walker / Vose alias method).
+// Every bin is picked with the same probability, then keeps its own index with probability q
+// or hands over to its alias, which together gives each index its share of the weights.
+//
+
+#ifndef RAYTRACING_ALIASTABLE_H
+#define RAYTRACING_ALIASTABLE_H
+
+#include <algorithm>
+#include <vector>
+
+class AliasTable
+{
+public:
+    AliasTable() {}
+    explicit AliasTable(const std::vector<float>& weights) { build(weights); }
+
+    // weights must not be negative, an all zero table stays empty
+    void build(const std::vector<float>& weights)
+    {
+        bins.clear();
+        double sum = 0.0;
+        for (float w : weights)
+            sum += w;
+        if (sum <= 0.0)
+            return;
+
+        int n = (int)weights.size();
+        bins.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<int> under, over;
+        for (int i = 0; i < n; ++i)
+        {
+            bins[i].pmf = (float)(weights[i] / sum);
+            scaled[i] = weights[i] / sum * n;
+            (scaled[i] < 1.0 ? under : over).push_back(i);
+        }
+        while (!under.empty() && !over.empty())
+        {
+            int small = under.back(), large = over.back();
+            under.pop_back();
+            bins[small].q = (float)scaled[small];
+            bins[small].alias = large;
+            scaled[large] -= 1.0 - scaled[small];
+            if (scaled[large] < 1.0)
+            {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+        // what is left is 1 up to rounding
+        for (int i : under) { bins[i].q = 1.0f; bins[i].alias = i; }
+        for (int i : over) { bins[i].q = 1.0f; bins[i].alias = i; }
+    }
+
+    // u1, u2 uniform in [0, 1), pmf receives the probability of the returned index
+    int sample(float u1, float u2, float& pmf) const
+    {
+        int bin = std::min((int)(u1 * bins.size()), (int)bins.size() - 1);
+        int index = u2 < bins[bin].q ? bin : bins[bin].alias;
+        pmf = bins[index].pmf;
+        return index;
+    }
+
+    float pmf(int index) const { return bins[index].pmf; }
+    int size() const { return (int)bins.size(); }
+    bool empty() const { return bins.empty(); }
+
+private:
+    struct Bin
+    {
+        float q = 1.0f;// probability of keeping this bin's own index
+        int alias = 0;
+        float pmf = 0.0f;
+    };
+    std::vector<Bin> bins;
+};
+
+#endif //RAYTRACING_ALIASTABLE_H
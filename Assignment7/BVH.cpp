@@ -1,114 +1,1934 @@
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <thread>
 #include "BVH.hpp"
+#include "Parallel.hpp"
+#include "Triangle.hpp"
+
+// SAH cost of one primitive intersection is 1, stepping through an interior node costs this much
+static const float SAH_TRAVERSAL_COST = 0.5f;
+static const int SAH_BUCKET_COUNT = 12;
+// subtrees with fewer primitives are built, optimized or refitted on the thread that reached them
+static const int PARALLEL_BUILD_CUTOFF = 16384;
+// triangle blocks or wide nodes of one level a refit thread takes at a time
+static const int REFIT_CHUNK_SIZE = 1024;
+// HLBVH treelets are the primitives sharing the top bits of their Morton codes
+static const int HLBVH_TREELET_BITS = 12;
+// SBVH: spatial splits are only tried where the best object split leaves children overlapping by more
+// than this fraction of the root area, with this many planes per axis, and references may grow by at most
+// SBVH_DUPLICATION_BUDGET times the triangle count
+static const float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+static const int SBVH_SPATIAL_BINS = 16;
+static const float SBVH_DUPLICATION_BUDGET = 0.3f;
+// optimize: leaves per restructured treelet, 7 as in the paper, and the relative SAH gain below which
+// another round is not worth it
+static const int OPTIMIZE_TREELET_LEAVES = 7;
+static const double OPTIMIZE_MIN_ROUND_GAIN = 1e-3;
+static const char* splitMethodNames[] = { "NAIVE", "SAH", "LBVH", "HLBVH", "SBVH" };
+
+static float axisOf(const Vector3f& v, int dim)
+{
+    return dim == 0 ? v.x : (dim == 1 ? v.y : v.z);
+}
+
+static float& axisRef(Vector3f& v, int dim)
+{
+    return dim == 0 ? v.x : (dim == 1 ? v.y : v.z);
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+    : root(nullptr), maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
-    if (primitives.empty())
-        return;
+    build(gatherPrimitiveInfo((int)primitives.size()));
+}
+
+BVHAccel::BVHAccel(Object* mesh, Material* material, const Vector3f* vertices, const uint32_t* vertexIndex,
+                   uint32_t numTriangles, int maxPrimsInNode, SplitMethod splitMethod)
+    : root(nullptr), maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      mesh(mesh), meshMaterial(material), meshVertices(vertices), meshVertexIndex(vertexIndex),
+      meshTriangleCount(numTriangles)
+{
+    build(gatherPrimitiveInfo((int)numTriangles));
+}
+
+BVHAccel::BVHAccel(Object* mesh, Material* material, const Vector3f* vertices, const uint32_t* vertexIndex,
+                   uint32_t numTriangles, int maxPrimsInNode, SplitMethod splitMethod, CacheReader& cache)
+    : root(nullptr), maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      mesh(mesh), meshMaterial(material), meshVertices(vertices), meshVertexIndex(vertexIndex),
+      meshTriangleCount(numTriangles)
+{
+    if (!readCache(cache, numTriangles))
+    {
+        triangles.clear();
+        wideNodes.clear();
+        triangleBlocks.clear();
+        return;
+    }
+    packedTriangles = true;
+    builtSAHCost = currentSAHCost = computeWideSAHCost();
+    printf("BVH read from cache: Primitives: %i, BVH%i nodes: %i, Triangle blocks: %i\n\n",
+        (int)triangles.size(), SIMD_WIDTH, (int)wideNodes.size(), (int)triangleBlocks.size());
+}
+
+static void deleteBuildTree(BVHBuildNode* node)
+{
+    if (node == nullptr)
+        return;
+    deleteBuildTree(node->left);
+    deleteBuildTree(node->right);
+    delete node;
+}
+
+// the primitives below a build tree node, counted only up to limit since callers just compare against it
+static int countPrimitives(const BVHBuildNode* node, int limit)
+{
+    if (node->left == nullptr && node->right == nullptr)
+        return node->nPrimitives;
+    int count = countPrimitives(node->left, limit);
+    return count >= limit ? count : count + countPrimitives(node->right, limit - count);
+}
+
+BVHAccel::~BVHAccel()
+{
+    deleteBuildTree(root);
+}
+
+void BVHAccel::writeCache(CacheWriter& cache) const
+{
+    // the binary nodes only feed the collapse into wide nodes, they are not stored
+    cache.writeArray(triangles);
+    cache.writeArray(wideNodes);
+    cache.writeArray(triangleBlocks);
+}
+
+bool BVHAccel::readCache(CacheReader& cache, uint32_t numTriangles)
+{
+    if (!cache.readArray(triangles) || !cache.readArray(wideNodes)
+        || !cache.readArray(triangleBlocks))
+        return false;
+
+    // the hash only says the OBJ did not change, check every index traversal follows so a damaged
+    // file is rebuilt instead of read out of bounds
+    if (triangles.size() < numTriangles || wideNodes.empty())//an SBVH references some triangles twice
+        return false;
+    for (uint32_t triangle : triangles)
+    {
+        if (triangle >= numTriangles)
+            return false;
+    }
+    for (const TriangleBlock& block : triangleBlocks)
+    {
+        for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        {
+            if (block.primitive[lane] < -1 || block.primitive[lane] >= (int)triangles.size())
+                return false;
+        }
+    }
+    for (size_t i = 0; i < wideNodes.size(); ++i)
+    {
+        const BVHWideNode& node = wideNodes[i];
+        if (node.childCount < 1 || node.childCount > SIMD_WIDTH)
+            return false;
+        for (int lane = 0; lane < node.childCount; ++lane)
+        {
+            int child = node.child[lane];
+            int blocks = (node.nPrimitives[lane] + SIMD_WIDTH - 1) / SIMD_WIDTH;
+            bool inRange = node.nPrimitives[lane] > 0
+                ? child >= 0 && (size_t)child + blocks <= triangleBlocks.size()
+                : child > (int)i && (size_t)child < wideNodes.size();//children come after their parent
+            if (!inRange)
+                return false;
+        }
+    }
+    return true;
+}
+
+// numbered in mesh or primitive list order
+std::vector<BVHPrimitiveInfo> BVHAccel::gatherPrimitiveInfo(int primitiveCount) const
+{
+    std::vector<BVHPrimitiveInfo> primitiveInfo(primitiveCount);
+    for (int i = 0; i < primitiveCount; ++i)
+    {
+        if (mesh)
+        {
+            const Vector3f& v0 = meshVertices[meshVertexIndex[i * 3]];
+            const Vector3f& v1 = meshVertices[meshVertexIndex[i * 3 + 1]];
+            const Vector3f& v2 = meshVertices[meshVertexIndex[i * 3 + 2]];
+            Bounds3 bounds = Union(Bounds3(v0, v1), v2);
+            primitiveInfo[i] = { i, bounds, bounds.Centroid() };
+        }
+        else
+        {
+            Bounds3 bounds = primitives[i]->getBounds();
+            primitiveInfo[i] = { i, bounds, bounds.Centroid() };
+        }
+    }
+    return primitiveInfo;
+}
+
+void BVHAccel::build(std::vector<BVHPrimitiveInfo> primitiveInfo)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (primitiveInfo.empty())
+        return;
+
+    int primitiveCount = (int)primitiveInfo.size();
+    int spareThreads = (int)std::thread::hardware_concurrency() - 1;
+#ifdef RECORD_RAY_HIT_PATH
+    spareThreads = 0;
+#endif
+    spareThreads = std::max(0, spareThreads);
+    if (splitMethod == SplitMethod::LBVH || splitMethod == SplitMethod::HLBVH)
+        root = buildMorton(primitiveInfo, spareThreads);
+    else if (splitMethod == SplitMethod::SBVH && mesh)
+        root = buildSBVH(primitiveInfo);
+    else
+        root = recursiveBuild(primitiveInfo, 0, primitiveCount, spareThreads);
+    primitiveCount = (int)primitiveInfo.size();//grows by the references spatial splits added
+
+    // the build partitions primitiveInfo in place, leaving it in leaf order
+    if (mesh)
+    {
+        triangles.resize(primitiveCount);
+        for (int i = 0; i < primitiveCount; ++i)
+        {
+            triangles[i] = (uint32_t)primitiveInfo[i].primitiveNumber;
+        }
+    }
+    else
+    {
+        std::vector<Object*> ordered(primitiveCount);
+        for (int i = 0; i < primitiveCount; ++i)
+        {
+            ordered[i] = primitives[primitiveInfo[i].primitiveNumber];
+        }
+        primitives.swap(ordered);
+    }
+
+    int interiorCount = 0, leafCount = 0;
+    double sahCost = computeSAHCost(root, root->bounds.SurfaceArea(), interiorCount, leafCount);
+
+    buildWideTree(interiorCount, leafCount, primitiveCount);
+    // the whole build up to the nodes the traversal walks, the stats below are not part of it
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf(
+        "\rBVH Generation complete: \nTime Taken: %.1f ms\n"
+        "Split: %s, Primitives: %i, Interior nodes: %i, Leaves: %i, SAH cost: %.3f, BVH%i nodes: %i\n\n",
+        milliseconds, splitMethodNames[(int)splitMethod],
+        primitiveCount, interiorCount, leafCount, sahCost, SIMD_WIDTH, (int)wideNodes.size());
+    if (splitMethod == SplitMethod::SBVH && mesh)
+    {
+        // the same build without spatial splits, only to report what they gained
+        std::vector<BVHPrimitiveInfo> objectSplitInfo = gatherPrimitiveInfo((int)meshTriangleCount);
+        BVHBuildNode* objectSplitRoot = recursiveBuild(objectSplitInfo, 0, (int)objectSplitInfo.size(), 0);
+        int objectSplitInteriors = 0, objectSplitLeaves = 0;
+        double objectSplitSAHCost = computeSAHCost(objectSplitRoot, objectSplitRoot->bounds.SurfaceArea(),
+                                                   objectSplitInteriors, objectSplitLeaves);
+        deleteBuildTree(objectSplitRoot);
+        printf("Spatial splits: %i, References: %i for %i triangles (+%.1f%%, budget %.0f%%), "
+            "SAH cost with object splits only: %.3f (%+.1f%%)\n\n",
+            spatialSplits, primitiveCount, (int)meshTriangleCount, 100.0 * duplicatedReferences / meshTriangleCount,
+            100.0 * SBVH_DUPLICATION_BUDGET, objectSplitSAHCost, 100.0 * (sahCost / objectSplitSAHCost - 1.0));
+    }
+    if (packedTriangles)
+    {
+        printf("Triangle blocks: %i x %i triangles, %i bytes\n\n",
+            (int)triangleBlocks.size(), SIMD_WIDTH, (int)(triangleBlocks.size() * sizeof(TriangleBlock)));
+    }
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& objects, int start, int end, int spareThreads)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+
+    // Compute bounds of all primitives in BVH node
+    Bounds3 bounds;
+    Bounds3 centroidBounds;//ȡµж󼸺ĵһAABB߽
+    for (int i = start; i < end; ++i)
+    {
+        bounds = Union(bounds, objects[i].bounds);
+        centroidBounds = Union(centroidBounds, objects[i].centroid);
+    }
+
+    int count = end - start;
+    int mid = start + count / 2;
+    int dimIndex = bounds.getMaxExtentDimensionIndex();
+    if (count == 1) //ֻһ壬Ϊӽڵ
+    {
+        return createLeaf(node, objects, start, end, bounds);
+    }
+    //ֻʣ壬ֱӷΪҲɻֵ (NAIVE), otherwise pick a split
+    if (count > 2 || splitMethod != SplitMethod::NAIVE)
+    {
+        dimIndex = centroidBounds.getMaxExtentDimensionIndex();
+        if (splitMethod == SplitMethod::SAH || splitMethod == SplitMethod::SBVH)
+        {
+            if (!partitionSAH(objects, start, end, bounds, centroidBounds, dimIndex, mid))
+            {
+                return createLeaf(node, objects, start, end, bounds);
+            }
+        }
+        else
+        {
+            // only the halves matter, not the order inside them
+            std::nth_element(objects.begin() + start, objects.begin() + mid, objects.begin() + end,
+                [dimIndex](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                    return axisOf(a.centroid, dimIndex) < axisOf(b.centroid, dimIndex);
+                });
+        }
+    }
+
+    // the halves are disjoint ranges of objects, so a large one can be built on another thread
+    node->splitAxis = dimIndex;
+    if (spareThreads > 0 && count >= PARALLEL_BUILD_CUTOFF)
+    {
+        int leftThreads = (spareThreads - 1) / 2;
+        std::thread leftBuilder([&]() { node->left = recursiveBuild(objects, start, mid, leftThreads); });
+        node->right = recursiveBuild(objects, mid, end, spareThreads - 1 - leftThreads);
+        leftBuilder.join();
+    }
+    else
+    {
+        node->left = recursiveBuild(objects, start, mid, 0);
+        node->right = recursiveBuild(objects, mid, end, 0);
+    }
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+BVHBuildNode* BVHAccel::createLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& objects, int start, int end,
+                                   const Bounds3& bounds)
+{
+    // Create leaf _BVHBuildNode_
+    node->bounds = bounds;
+    node->object = mesh ? mesh : primitives[objects[start].primitiveNumber];
+    node->left = nullptr;
+    node->right = nullptr;
+    node->firstPrimOffset = start;//objects ends up in leaf order
+    node->nPrimitives = end - start;
+    return node;
+}
+
+// spreads the low 21 bits of x out to every third bit
+static uint64_t expandBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+struct MortonPrimitive
+{
+    uint64_t code;
+    int index;
+};
+
+// Stable LSD radix sort on the low bits of the codes, 8 bits a pass. Every chunk of the array is
+// counted and scattered by its own thread, chunks keep their order inside a bucket
+static void radixSort(std::vector<MortonPrimitive>& values, int bits, int threadCount)
+{
+    const int bucketBits = 8, bucketCount = 1 << bucketBits;
+    int size = (int)values.size();
+    int chunkCount = std::max(1, std::min(threadCount, size / PARALLEL_BUILD_CUTOFF));
+    int chunkSize = (size + chunkCount - 1) / chunkCount;
+    std::vector<MortonPrimitive> sorted(values.size());
+    std::vector<int> offsets(chunkCount * bucketCount);
+    for (int shift = 0; shift < bits; shift += bucketBits)
+    {
+        auto bucketOf = [shift](const MortonPrimitive& value) { return (int)(value.code >> shift) & (bucketCount - 1); };
+        parallelFor(chunkCount, threadCount, [&](int c) {
+            int* count = &offsets[c * bucketCount];
+            std::fill(count, count + bucketCount, 0);
+            for (int i = c * chunkSize; i < std::min(size, (c + 1) * chunkSize); ++i)
+                count[bucketOf(values[i])]++;
+        });
+        int offset = 0;
+        for (int b = 0; b < bucketCount; ++b)
+        {
+            for (int c = 0; c < chunkCount; ++c)
+            {
+                int count = offsets[c * bucketCount + b];
+                offsets[c * bucketCount + b] = offset;
+                offset += count;
+            }
+        }
+        parallelFor(chunkCount, threadCount, [&](int c) {
+            int* next = &offsets[c * bucketCount];
+            for (int i = c * chunkSize; i < std::min(size, (c + 1) * chunkSize); ++i)
+                sorted[next[bucketOf(values[i])]++] = values[i];
+        });
+        values.swap(sorted);
+    }
+}
+
+// Linear BVH: sort the primitives along a Morton curve through their centroids, then every split is where a
+// code bit changes inside a node. HLBVH builds that below the top bits and joins the treelets with SAH
+BVHBuildNode* BVHAccel::buildMorton(std::vector<BVHPrimitiveInfo>& primitiveInfo, int spareThreads)
+{
+    int count = (int)primitiveInfo.size();
+    int threadCount = spareThreads + 1;
+    Bounds3 centroidBounds;
+    for (const BVHPrimitiveInfo& info : primitiveInfo)
+    {
+        centroidBounds = Union(centroidBounds, info.centroid);
+    }
+
+    // 10 bits an axis give a 1024^3 grid, large meshes get 21 so the cells do not fill up
+    int axisBits = count > (1 << 18) ? 21 : 10;
+    int codeBits = 3 * axisBits;
+    // cubic cells: scaling each axis to its own extent would cut flat meshes across their thin side as often
+    // as along the others, into children that overlap almost entirely
+    Vector3f diagonal = centroidBounds.Diagonal();
+    float extent = std::max(diagonal.x, std::max(diagonal.y, diagonal.z));
+    float scale = (float)((1 << axisBits) - 1);
+    std::vector<MortonPrimitive> morton(count);
+    parallelFor((count + PARALLEL_BUILD_CUTOFF - 1) / PARALLEL_BUILD_CUTOFF, threadCount, [&](int chunk) {
+        for (int i = chunk * PARALLEL_BUILD_CUTOFF; i < std::min(count, (chunk + 1) * PARALLEL_BUILD_CUTOFF); ++i)
+        {
+            uint64_t cell[3];
+            for (int dim = 0; dim < 3; ++dim)
+            {
+                float offset = extent > 0.0f ? (axisOf(primitiveInfo[i].centroid, dim) - axisOf(centroidBounds.pMin, dim)) / extent : 0.0f;
+                cell[dim] = (uint64_t)std::min(std::max(offset * scale, 0.0f), scale);
+            }
+            morton[i] = { expandBits(cell[0]) << 2 | expandBits(cell[1]) << 1 | expandBits(cell[2]), i };
+        }
+    });
+    radixSort(morton, codeBits, threadCount);
+
+    // leaves cover ranges of the sorted order, so primitiveInfo itself is put in that order
+    std::vector<BVHPrimitiveInfo> sortedInfo(count);
+    std::vector<uint64_t> mortonCodes(count);
+    for (int i = 0; i < count; ++i)
+    {
+        sortedInfo[i] = primitiveInfo[morton[i].index];
+        mortonCodes[i] = morton[i].code;
+    }
+    primitiveInfo.swap(sortedInfo);
+
+    if (splitMethod == SplitMethod::LBVH)
+        return emitLBVH(primitiveInfo, mortonCodes, 0, count, codeBits - 1, spareThreads);
+
+    int treeletShift = std::max(0, codeBits - HLBVH_TREELET_BITS);
+    std::vector<std::pair<int, int>> treelets;
+    for (int start = 0, end = 1; end <= count; ++end)
+    {
+        if (end == count || (mortonCodes[start] >> treeletShift) != (mortonCodes[end] >> treeletShift))
+        {
+            treelets.push_back({ start, end });
+            start = end;
+        }
+    }
+    std::vector<BVHBuildNode*> treeletRoots(treelets.size());
+    parallelFor((int)treelets.size(), threadCount, [&](int t) {
+        treeletRoots[t] = emitLBVH(primitiveInfo, mortonCodes, treelets[t].first, treelets[t].second, treeletShift - 1, 0);
+    });
+
+    std::vector<BVHPrimitiveInfo> treeletInfo(treelets.size());
+    for (int t = 0; t < (int)treelets.size(); ++t)
+    {
+        Bounds3 bounds = treeletRoots[t]->bounds;
+        treeletInfo[t] = { t, bounds, bounds.Centroid() };
+    }
+    return buildUpperSAH(treeletRoots, treeletInfo, 0, (int)treelets.size());
+}
+
+BVHBuildNode* BVHAccel::emitLBVH(std::vector<BVHPrimitiveInfo>& objects, const std::vector<uint64_t>& mortonCodes,
+                                 int start, int end, int bitIndex, int spareThreads)
+{
+    int count = end - start;
+    if (count <= maxPrimsInNode)
+    {
+        Bounds3 bounds;
+        for (int i = start; i < end; ++i)
+        {
+            bounds = Union(bounds, objects[i].bounds);
+        }
+        return createLeaf(new BVHBuildNode(), objects, start, end, bounds);
+    }
+
+    // skip the bits every code in the node shares, once they run out the codes are equal and the node is halved
+    int mid = start + count / 2;
+    while (bitIndex >= 0)
+    {
+        uint64_t mask = 1ull << bitIndex;
+        if ((mortonCodes[start] & mask) != (mortonCodes[end - 1] & mask))
+        {
+            mid = (int)(std::partition_point(mortonCodes.begin() + start, mortonCodes.begin() + end,
+                [mask](uint64_t code) { return (code & mask) == 0; }) - mortonCodes.begin());
+            break;
+        }
+        --bitIndex;
+    }
+
+    BVHBuildNode* node = new BVHBuildNode();
+    node->splitAxis = bitIndex >= 0 ? 2 - bitIndex % 3 : 0;//x is the highest bit of each triple
+    if (spareThreads > 0 && count >= PARALLEL_BUILD_CUTOFF)
+    {
+        int leftThreads = (spareThreads - 1) / 2;
+        std::thread leftBuilder([&]() { node->left = emitLBVH(objects, mortonCodes, start, mid, bitIndex - 1, leftThreads); });
+        node->right = emitLBVH(objects, mortonCodes, mid, end, bitIndex - 1, spareThreads - 1 - leftThreads);
+        leftBuilder.join();
+    }
+    else
+    {
+        node->left = emitLBVH(objects, mortonCodes, start, mid, bitIndex - 1, 0);
+        node->right = emitLBVH(objects, mortonCodes, mid, end, bitIndex - 1, 0);
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+// SAH over the treelet roots, which are never split further
+BVHBuildNode* BVHAccel::buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, std::vector<BVHPrimitiveInfo>& treeletInfo,
+                                      int start, int end)
+{
+    int count = end - start;
+    if (count == 1)
+        return treeletRoots[treeletInfo[start].primitiveNumber];
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i)
+    {
+        bounds = Union(bounds, treeletInfo[i].bounds);
+        centroidBounds = Union(centroidBounds, treeletInfo[i].centroid);
+    }
+    int dim = centroidBounds.getMaxExtentDimensionIndex();
+    int mid = start + count / 2;
+    if (!partitionSAH(treeletInfo, start, end, bounds, centroidBounds, dim, mid))
+    {
+        // a leaf would be cheaper, but treelets can not share one
+        std::nth_element(treeletInfo.begin() + start, treeletInfo.begin() + mid, treeletInfo.begin() + end,
+            [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                return axisOf(a.centroid, dim) < axisOf(b.centroid, dim);
+            });
+    }
+
+    BVHBuildNode* node = new BVHBuildNode();
+    node->splitAxis = dim;
+    node->left = buildUpperSAH(treeletRoots, treeletInfo, start, mid);
+    node->right = buildUpperSAH(treeletRoots, treeletInfo, mid, end);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+// Binned SAH: drop the centroids into buckets along dim and split at the cheapest bucket boundary.
+// Returns false when keeping all objects in one leaf is cheaper than any split.
+static int sahBucket(const Vector3f& centroid, int dim, float centroidMin, float centroidMax)
+{
+    float offset = (axisOf(centroid, dim) - centroidMin) / (centroidMax - centroidMin);
+    return std::min((int)(SAH_BUCKET_COUNT * offset), SAH_BUCKET_COUNT - 1);
+}
+
+// Binned SAH along dim: the cheapest bucket boundary and the children's boxes it gives, the boundary is -1
+// when the centroids can not be told apart. The cost is left unnormalized by the node area
+double BVHAccel::findSAHSplit(const std::vector<BVHPrimitiveInfo>& objects, int start, int end,
+                              const Bounds3& centroidBounds, int dim, int& bestBoundary,
+                              Bounds3& leftBounds, Bounds3& rightBounds) const
+{
+    double bestCost = std::numeric_limits<double>::max();
+    bestBoundary = -1;
+    float centroidMin = axisOf(centroidBounds.pMin, dim);
+    float centroidMax = axisOf(centroidBounds.pMax, dim);
+    if (centroidMax <= centroidMin)
+        return bestCost;
+
+    int bucketCount[SAH_BUCKET_COUNT] = {};
+    Bounds3 bucketBounds[SAH_BUCKET_COUNT];
+    for (int i = start; i < end; ++i)
+    {
+        const BVHPrimitiveInfo& object = objects[i];
+        int b = sahBucket(object.centroid, dim, centroidMin, centroidMax);
+        bucketCount[b]++;
+        bucketBounds[b] = Union(bucketBounds[b], object.bounds);
+    }
+
+    // sweep from the right once so every boundary is evaluated in constant time
+    int rightCount[SAH_BUCKET_COUNT] = {};
+    Bounds3 rightSweep[SAH_BUCKET_COUNT];
+    Bounds3 sweepBounds;
+    int sweepCount = 0;
+    for (int b = SAH_BUCKET_COUNT - 1; b > 0; --b)
+    {
+        sweepBounds = Union(sweepBounds, bucketBounds[b]);
+        sweepCount += bucketCount[b];
+        rightCount[b] = sweepCount;
+        rightSweep[b] = sweepBounds;
+    }
+
+    // boundary b puts buckets [0, b) on the left and [b, SAH_BUCKET_COUNT) on the right
+    sweepBounds = Bounds3();
+    sweepCount = 0;
+    for (int b = 1; b < SAH_BUCKET_COUNT; ++b)
+    {
+        sweepBounds = Union(sweepBounds, bucketBounds[b - 1]);
+        sweepCount += bucketCount[b - 1];
+        if (sweepCount == 0 || rightCount[b] == 0)
+            continue;
+        double cost = sweepCount * sweepBounds.SurfaceArea() + rightCount[b] * rightSweep[b].SurfaceArea();
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestBoundary = b;
+            leftBounds = sweepBounds;
+            rightBounds = rightSweep[b];
+        }
+    }
+    return bestCost;
+}
+
+bool BVHAccel::partitionSAH(std::vector<BVHPrimitiveInfo>& objects, int start, int end, const Bounds3& bounds,
+                            const Bounds3& centroidBounds, int dim, int& middle) const
+{
+    int count = end - start;
+    float centroidMin = axisOf(centroidBounds.pMin, dim);
+    float centroidMax = axisOf(centroidBounds.pMax, dim);
+    if (centroidMax <= centroidMin)//all centroids coincide, buckets can not tell the objects apart
+    {
+        middle = start + count / 2;
+        return count > maxPrimsInNode;
+    }
+
+    int bestBoundary = -1;
+    Bounds3 leftBounds, rightBounds;
+    double bestCost = findSAHSplit(objects, start, end, centroidBounds, dim, bestBoundary, leftBounds, rightBounds);
+
+    // both costs are kept unnormalized by the node area so flat nodes do not divide by zero
+    double leafCost = (count - SAH_TRAVERSAL_COST) * bounds.SurfaceArea();
+    if (count <= maxPrimsInNode && leafCost <= bestCost)
+        return false;
+
+    auto split = std::partition(objects.begin() + start, objects.begin() + end, [&](const BVHPrimitiveInfo& object) {
+        return sahBucket(object.centroid, dim, centroidMin, centroidMax) < bestBoundary;
+    });
+    middle = (int)(split - objects.begin());
+    return true;
+}
+
+// SBVH (Stich et al. 2009)
+
+struct SBVHBuildState
+{
+    double rootArea;
+    int duplicateBudget;//references spatial splits may still add
+    std::vector<BVHPrimitiveInfo> leafOrder;//references of the leaves emitted so far
+};
+
+static Bounds3 boundsIntersection(const Bounds3& a, const Bounds3& b)
+{
+    Bounds3 result;
+    result.pMin = Vector3f::Max(a.pMin, b.pMin);
+    result.pMax = Vector3f::Min(a.pMax, b.pMax);
+    return result;
+}
+
+static bool isEmpty(const Bounds3& b)
+{
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+// box around the part of the triangle between the planes lo and hi across axis dim
+static Bounds3 clipTriangle(const Vector3f v[3], int dim, float lo, float hi)
+{
+    Bounds3 clipped;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3f& a = v[i];
+        const Vector3f& b = v[(i + 1) % 3];
+        float pa = axisOf(a, dim), pb = axisOf(b, dim);
+        if (pa >= lo && pa <= hi)
+            clipped = Union(clipped, a);
+        for (float plane : { lo, hi })
+        {
+            if ((pa < plane && plane < pb) || (pb < plane && plane < pa))
+            {
+                Vector3f p = a + (b - a) * ((plane - pa) / (pb - pa));
+                axisRef(p, dim) = plane;
+                clipped = Union(clipped, p);
+            }
+        }
+    }
+    return clipped;
+}
+
+static int spatialBin(float position, float lo, float binWidth)
+{
+    return std::max(0, std::min((int)((position - lo) / binWidth), SBVH_SPATIAL_BINS - 1));
+}
+
+BVHBuildNode* BVHAccel::buildSBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo)
+{
+    Bounds3 bounds;
+    for (const BVHPrimitiveInfo& primitive : primitiveInfo)
+    {
+        bounds = Union(bounds, primitive.bounds);
+    }
+    SBVHBuildState state;
+    state.rootArea = bounds.SurfaceArea();
+    state.duplicateBudget = (int)(primitiveInfo.size() * SBVH_DUPLICATION_BUDGET);
+    state.leafOrder.reserve(primitiveInfo.size() + state.duplicateBudget);
+    spatialSplits = 0;
+    duplicatedReferences = 0;
+
+    // references multiply, so the build can not stay inside primitiveInfo; the leaves collect them in leaf order
+    BVHBuildNode* node = recursiveBuildSBVH(primitiveInfo, state);
+    primitiveInfo.swap(state.leafOrder);
+    return node;
+}
+
+// The references of one node come in and are consumed, each child gets a list of its own.
+// Runs on one thread: the leaves are appended to state.leafOrder in order
+BVHBuildNode* BVHAccel::recursiveBuildSBVH(std::vector<BVHPrimitiveInfo>& references, SBVHBuildState& state)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+    Bounds3 bounds, centroidBounds;
+    for (const BVHPrimitiveInfo& reference : references)
+    {
+        bounds = Union(bounds, reference.bounds);
+        centroidBounds = Union(centroidBounds, reference.centroid);
+    }
+    int count = (int)references.size();
+    auto emitLeaf = [&]() {
+        int firstPrimOffset = (int)state.leafOrder.size();
+        state.leafOrder.insert(state.leafOrder.end(), references.begin(), references.end());
+        createLeaf(node, references, 0, count, bounds);
+        node->firstPrimOffset = firstPrimOffset;
+        return node;
+    };
+    if (count == 1)
+        return emitLeaf();
+
+    int dim = centroidBounds.getMaxExtentDimensionIndex();
+    int objectBoundary = -1;
+    Bounds3 objectLeft, objectRight;
+    double objectCost = findSAHSplit(references, 0, count, centroidBounds, dim, objectBoundary, objectLeft, objectRight);
+
+    // a spatial split only pays where the object split's children overlap, and it costs duplicates
+    double spatialCost = std::numeric_limits<double>::max();
+    int spatialDim = -1, spatialPlane = 0, duplicates = 0;
+    Bounds3 spatialLeft, spatialRight;
+    Bounds3 overlap = boundsIntersection(objectLeft, objectRight);
+    bool overlapping = objectBoundary < 0
+        || (!isEmpty(overlap) && overlap.SurfaceArea() > SBVH_OVERLAP_THRESHOLD * state.rootArea);
+    if (state.duplicateBudget > 0 && overlapping)
+    {
+        spatialCost = findSpatialSplit(references, bounds, spatialDim, spatialPlane, spatialLeft, spatialRight, duplicates);
+        if (spatialDim < 0 || duplicates > state.duplicateBudget)
+            spatialCost = std::numeric_limits<double>::max();
+    }
+
+    double leafCost = (count - SAH_TRAVERSAL_COST) * bounds.SurfaceArea();
+    double bestCost = std::min(objectCost, spatialCost);
+    if (count <= maxPrimsInNode && leafCost <= bestCost)
+        return emitLeaf();
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    bool spatialSplit = false;
+    if (spatialCost < objectCost)
+    {
+        float lo = axisOf(bounds.pMin, spatialDim);
+        float binWidth = (axisOf(bounds.pMax, spatialDim) - lo) / SBVH_SPATIAL_BINS;
+        float position = lo + spatialPlane * binWidth;
+        // sides are decided by bins exactly as findSpatialSplit counted them
+        std::vector<BVHPrimitiveInfo> straddling;
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            if (spatialBin(axisOf(reference.bounds.pMax, spatialDim), lo, binWidth) < spatialPlane)
+                left.push_back(reference);
+            else if (spatialBin(axisOf(reference.bounds.pMin, spatialDim), lo, binWidth) >= spatialPlane)
+                right.push_back(reference);
+            else
+                straddling.push_back(reference);
+        }
+
+        // a straddling reference stays whole on one side when that is cheaper than splitting it
+        double leftArea = spatialLeft.SurfaceArea(), rightArea = spatialRight.SurfaceArea();
+        int leftCount = (int)(left.size() + straddling.size()), rightCount = (int)(right.size() + straddling.size());
+        for (const BVHPrimitiveInfo& reference : straddling)
+        {
+            BVHPrimitiveInfo leftPart, rightPart;
+            splitReference(reference, spatialDim, position, leftPart, rightPart);
+            double splitCost = leftArea * leftCount + rightArea * rightCount;
+            double leftOnlyCost = Union(spatialLeft, reference.bounds).SurfaceArea() * leftCount + rightArea * (rightCount - 1);
+            double rightOnlyCost = leftArea * (leftCount - 1) + Union(spatialRight, reference.bounds).SurfaceArea() * rightCount;
+            if (isEmpty(rightPart.bounds) || (!isEmpty(leftPart.bounds) && leftOnlyCost < std::min(splitCost, rightOnlyCost)))
+            {
+                left.push_back(reference);
+                rightCount--;
+            }
+            else if (isEmpty(leftPart.bounds) || rightOnlyCost < splitCost)
+            {
+                right.push_back(reference);
+                leftCount--;
+            }
+            else
+            {
+                left.push_back(leftPart);
+                right.push_back(rightPart);
+            }
+        }
+        // unsplitting can move every reference to one side, the split would make no progress then
+        spatialSplit = !left.empty() && !right.empty();
+        if (spatialSplit)
+        {
+            int added = (int)(left.size() + right.size()) - count;
+            state.duplicateBudget -= added;
+            duplicatedReferences += added;
+            spatialSplits++;
+            dim = spatialDim;
+        }
+        else
+        {
+            left.clear();
+            right.clear();
+        }
+    }
+    if (!spatialSplit && objectBoundary >= 0)
+    {
+        float centroidMin = axisOf(centroidBounds.pMin, dim), centroidMax = axisOf(centroidBounds.pMax, dim);
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            (sahBucket(reference.centroid, dim, centroidMin, centroidMax) < objectBoundary ? left : right).push_back(reference);
+        }
+    }
+    else if (!spatialSplit)
+    {
+        // centroids coincide and no plane helps, halve the list as partitionSAH does
+        if (count <= maxPrimsInNode)
+            return emitLeaf();
+        left.assign(references.begin(), references.begin() + count / 2);
+        right.assign(references.begin() + count / 2, references.end());
+    }
+
+    // the parent's list is not needed any more, free it before the subtrees allocate theirs
+    std::vector<BVHPrimitiveInfo>().swap(references);
+    node->splitAxis = dim;
+    node->left = recursiveBuildSBVH(left, state);
+    node->right = recursiveBuildSBVH(right, state);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+// Cuts the node box at SBVH_SPATIAL_BINS - 1 planes per axis. A reference is counted on every side it reaches
+// and adds only its part on that side to the side's box. Returns the cheapest plane's cost, unnormalized like
+// findSAHSplit, and how many references splitting there would add
+double BVHAccel::findSpatialSplit(const std::vector<BVHPrimitiveInfo>& references, const Bounds3& bounds, int& bestDim,
+                                  int& bestPlane, Bounds3& leftBounds, Bounds3& rightBounds, int& duplicates) const
+{
+    double bestCost = std::numeric_limits<double>::max();
+    bestDim = -1;
+    int count = (int)references.size();
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        float lo = axisOf(bounds.pMin, dim);
+        float binWidth = (axisOf(bounds.pMax, dim) - lo) / SBVH_SPATIAL_BINS;
+        if (!(binWidth > 0.0f))
+            continue;
+
+        Bounds3 binBounds[SBVH_SPATIAL_BINS];
+        int entries[SBVH_SPATIAL_BINS] = {}, exits[SBVH_SPATIAL_BINS] = {};
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            int first = spatialBin(axisOf(reference.bounds.pMin, dim), lo, binWidth);
+            int last = spatialBin(axisOf(reference.bounds.pMax, dim), lo, binWidth);
+            entries[first]++;
+            exits[last]++;
+            if (first == last)
+            {
+                binBounds[first] = Union(binBounds[first], reference.bounds);
+                continue;
+            }
+            Vector3f v[3];
+            const uint32_t* index = meshVertexIndex + reference.primitiveNumber * 3;
+            for (int k = 0; k < 3; ++k)
+                v[k] = meshVertices[index[k]];
+            for (int b = first; b <= last; ++b)
+            {
+                // the outer bins reach as far as the reference does
+                float binLo = b == first ? -std::numeric_limits<float>::infinity() : lo + b * binWidth;
+                float binHi = b == last ? std::numeric_limits<float>::infinity() : lo + (b + 1) * binWidth;
+                Bounds3 part = boundsIntersection(clipTriangle(v, dim, binLo, binHi), reference.bounds);
+                if (!isEmpty(part))
+                    binBounds[b] = Union(binBounds[b], part);
+            }
+        }
+
+        Bounds3 rightSweep[SBVH_SPATIAL_BINS];
+        int rightCount[SBVH_SPATIAL_BINS] = {};
+        Bounds3 sweepBounds;
+        int sweepCount = 0;
+        for (int b = SBVH_SPATIAL_BINS - 1; b > 0; --b)
+        {
+            sweepBounds = Union(sweepBounds, binBounds[b]);
+            sweepCount += exits[b];
+            rightSweep[b] = sweepBounds;
+            rightCount[b] = sweepCount;
+        }
+        // plane p lies between bins p - 1 and p
+        sweepBounds = Bounds3();
+        sweepCount = 0;
+        for (int plane = 1; plane < SBVH_SPATIAL_BINS; ++plane)
+        {
+            sweepBounds = Union(sweepBounds, binBounds[plane - 1]);
+            sweepCount += entries[plane - 1];
+            // both sides have to lose something, or the same references would be split again below
+            if (sweepCount == 0 || rightCount[plane] == 0 || sweepCount == count || rightCount[plane] == count)
+                continue;
+            double cost = sweepCount * sweepBounds.SurfaceArea() + rightCount[plane] * rightSweep[plane].SurfaceArea();
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestDim = dim;
+                bestPlane = plane;
+                leftBounds = sweepBounds;
+                rightBounds = rightSweep[plane];
+                duplicates = sweepCount + rightCount[plane] - count;
+            }
+        }
+    }
+    return bestCost;
+}
+
+// the parts of a reference on either side of the plane, each clipped to its side
+void BVHAccel::splitReference(const BVHPrimitiveInfo& reference, int dim, float position,
+                              BVHPrimitiveInfo& left, BVHPrimitiveInfo& right) const
+{
+    Vector3f v[3];
+    const uint32_t* index = meshVertexIndex + reference.primitiveNumber * 3;
+    for (int k = 0; k < 3; ++k)
+        v[k] = meshVertices[index[k]];
+    left = right = reference;
+    left.bounds = boundsIntersection(clipTriangle(v, dim, -std::numeric_limits<float>::infinity(), position),
+                                     reference.bounds);
+    right.bounds = boundsIntersection(clipTriangle(v, dim, position, std::numeric_limits<float>::infinity()),
+                                      reference.bounds);
+    left.centroid = left.bounds.Centroid();
+    right.centroid = right.bounds.Centroid();
+}
+
+double BVHAccel::computeSAHCost(BVHBuildNode* node, double rootArea, int& interiorCount, int& leafCount) const
+{
+    double areaRatio = rootArea > 0.0 ? node->bounds.SurfaceArea() / rootArea : 1.0;
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        leafCount++;
+        return node->nPrimitives * areaRatio;
+    }
+    interiorCount++;
+    return SAH_TRAVERSAL_COST * areaRatio
+        + computeSAHCost(node->left, rootArea, interiorCount, leafCount)
+        + computeSAHCost(node->right, rootArea, interiorCount, leafCount);
+}
+
+// the build tree flattened and collapsed into what the traversal walks
+void BVHAccel::buildWideTree(int interiorCount, int leafCount, int primitiveCount)
+{
+    nodes.resize(interiorCount + leafCount);
+    int offset = 0;
+    flattenBVHTree(root, offset);
+    packedTriangles = mesh != nullptr;
+    // upper bounds, so the arrays are not copied while growing: every wide node holds at least two binary
+    // children, every leaf needs at most one partly filled block
+    wideNodes.reserve(interiorCount + 1);
+    if (packedTriangles)
+    {
+        triangleBlocks.reserve(leafCount + primitiveCount / SIMD_WIDTH);
+    }
+    collapseWideNode(0);
+    // the binary nodes were only needed for the collapse, the traversal walks the wide nodes
+    nodes.clear();
+    nodes.shrink_to_fit();
+    builtSAHCost = currentSAHCost = computeWideSAHCost();
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int& offset)
+{
+    LinearBVHNode* linearNode = &nodes[offset];
+    linearNode->bounds = node->bounds;
+    int nodeOffset = offset++;
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        linearNode->primitivesOffset = node->firstPrimOffset;
+        linearNode->nPrimitives = (uint16_t)node->nPrimitives;
+    }
+    else
+    {
+        linearNode->axis = (uint8_t)node->splitAxis;
+        linearNode->nPrimitives = 0;
+        flattenBVHTree(node->left, offset);
+        linearNode->secondChildOffset = flattenBVHTree(node->right, offset);
+    }
+    return nodeOffset;
+}
+
+int BVHAccel::collapseWideNode(int linearIndex)
+{
+    // start from the binary children and keep opening the interior candidate with the largest
+    // surface area until every lane is used, so the wide node absorbs its most likely hit levels
+    int candidates[SIMD_WIDTH];
+    int count = 0;
+    const LinearBVHNode& linearNode = nodes[linearIndex];
+    if (linearNode.nPrimitives > 0)//the whole tree is one leaf
+    {
+        candidates[count++] = linearIndex;
+    }
+    else
+    {
+        candidates[count++] = linearIndex + 1;
+        candidates[count++] = linearNode.secondChildOffset;
+    }
+    while (count < SIMD_WIDTH)
+    {
+        int best = -1;
+        double bestArea = -1.0;
+        for (int i = 0; i < count; ++i)
+        {
+            const LinearBVHNode& candidate = nodes[candidates[i]];
+            if (candidate.nPrimitives == 0 && candidate.bounds.SurfaceArea() > bestArea)
+            {
+                best = i;
+                bestArea = candidate.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = candidates[best];
+        candidates[best] = opened + 1;
+        candidates[count++] = nodes[opened].secondChildOffset;
+    }
+
+    int wideIndex = (int)wideNodes.size();
+    wideNodes.emplace_back();
+    BVHWideNode wideNode;
+    wideNode.childCount = count;
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+    {
+        // unused lanes get an inverted box, childCount masks them out anyway
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            wideNode.boundsMin[dim][lane] = std::numeric_limits<float>::infinity();
+            wideNode.boundsMax[dim][lane] = -std::numeric_limits<float>::infinity();
+        }
+        wideNode.child[lane] = -1;
+        wideNode.nPrimitives[lane] = 0;
+    }
+    for (int lane = 0; lane < count; ++lane)
+    {
+        const LinearBVHNode& child = nodes[candidates[lane]];
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            wideNode.boundsMin[dim][lane] = axisOf(child.bounds.pMin, dim);
+            wideNode.boundsMax[dim][lane] = axisOf(child.bounds.pMax, dim);
+        }
+        if (child.nPrimitives > 0)
+        {
+            wideNode.child[lane] = packedTriangles ? packTriangleLeaf(child.primitivesOffset, child.nPrimitives)
+                                                   : child.primitivesOffset;
+            wideNode.nPrimitives[lane] = child.nPrimitives;
+        }
+        else
+        {
+            wideNode.child[lane] = collapseWideNode(candidates[lane]);
+        }
+    }
+    wideNodes[wideIndex] = wideNode;//written last, the recursion above may have grown wideNodes
+    return wideIndex;
+}
+
+int BVHAccel::packTriangleLeaf(int primitivesOffset, int nPrimitives)
+{
+    int firstBlock = (int)triangleBlocks.size();
+    for (int first = 0; first < nPrimitives; first += SIMD_WIDTH)
+    {
+        TriangleBlock block;
+        for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        {
+            Vector3f v0, e1, e2;
+            block.primitive[lane] = -1;
+            if (first + lane < nPrimitives)
+            {
+                block.primitive[lane] = primitivesOffset + first + lane;
+                Vector3f v1, v2;
+                getTriangle(block.primitive[lane], v0, v1, v2);
+                e1 = v1 - v0;
+                e2 = v2 - v0;
+            }
+            for (int dim = 0; dim < 3; ++dim)
+            {
+                block.v0[dim][lane] = axisOf(v0, dim);
+                block.e1[dim][lane] = axisOf(e1, dim);
+                block.e2[dim][lane] = axisOf(e2, dim);
+            }
+        }
+        triangleBlocks.push_back(block);
+    }
+    return firstBlock;
+}
 
-    root = recursiveBuild(primitives);
+// Treelet restructuring (Karras and Aila 2013)
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+void BVHAccel::optimize(double timeBudget)
+{
+    if (root == nullptr || timeBudget <= 0.0)
+        return;
+    int spareThreads = (int)std::thread::hardware_concurrency() - 1;
+#ifdef RECORD_RAY_HIT_PATH
+    spareThreads = 0;
+#endif
+    spareThreads = std::max(0, spareThreads);
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeBudget));
+    int interiorCount = 0, leafCount = 0;
+    double initialCost = computeSAHCost(root, root->bounds.SurfaceArea(), interiorCount, leafCount);
+    double cost = initialCost;
+    int rounds = 0, restructuredTotal = 0;
+    // every round starts from the treelets the last one left, so later rounds find what earlier ones enabled
+    while (Clock::now() < deadline)
+    {
+        std::atomic<int> restructured(0);
+        optimizeSubtree(root, spareThreads, deadline, restructured);
+        ++rounds;
+        restructuredTotal += restructured;
+        interiorCount = leafCount = 0;
+        double roundCost = computeSAHCost(root, root->bounds.SurfaceArea(), interiorCount, leafCount);
+        bool paid = roundCost < cost * (1.0 - OPTIMIZE_MIN_ROUND_GAIN);
+        cost = roundCost;
+        if (!paid)
+            break;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // the leaves did not change, only the interior nodes above them
+    wideNodes.clear();
+    compressedNodes.clear();
+    triangleBlocks.clear();
+    refitOrder.clear();
+    refitLevelStart.clear();
+    buildWideTree(interiorCount, leafCount, (int)(mesh ? triangles.size() : primitives.size()));
+    printf("BVH optimized: %i rounds, %i treelets restructured in %.2f s (budget %.2f s), SAH cost: %.3f -> %.3f (%+.1f%%)\n\n",
+        rounds, restructuredTotal, seconds, timeBudget, initialCost, cost, 100.0 * (cost / initialCost - 1.0));
+    if (nodesCompressed)
+        compressNodes();
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+// Restructures the subtree bottom up, so every treelet is formed from subtrees that are already optimized
+// and whose costs are known. Once the deadline passed nothing more is touched: every node handled later
+// also sees it passed, so no treelet is formed over nodes whose cost was not updated
+bool BVHAccel::optimizeSubtree(BVHBuildNode* node, int spareThreads, std::chrono::steady_clock::time_point deadline,
+                               std::atomic<int>& restructured)
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        node->cost = node->nPrimitives * node->bounds.SurfaceArea();
+        return true;
+    }
+    bool inTime;
+    if (spareThreads > 0 && countPrimitives(node, PARALLEL_BUILD_CUTOFF) >= PARALLEL_BUILD_CUTOFF)
+    {
+        int leftThreads = (spareThreads - 1) / 2;
+        bool leftInTime = false;
+        std::thread leftOptimizer([&]() { leftInTime = optimizeSubtree(node->left, leftThreads, deadline, restructured); });
+        inTime = optimizeSubtree(node->right, spareThreads - 1 - leftThreads, deadline, restructured);
+        leftOptimizer.join();
+        inTime = inTime && leftInTime;
+    }
+    else
+    {
+        inTime = optimizeSubtree(node->left, 0, deadline, restructured)
+            && optimizeSubtree(node->right, 0, deadline, restructured);
+    }
+    if (!inTime || std::chrono::steady_clock::now() >= deadline)
+        return false;
+    node->cost = SAH_TRAVERSAL_COST * node->bounds.SurfaceArea() + node->left->cost + node->right->cost;
+    if (restructureTreelet(node))
+        restructured++;
+    return true;
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
+// Grows a treelet below treeletRoot by opening its largest leaf until it has OPTIMIZE_TREELET_LEAVES, then
+// finds the cheapest binary tree over those leaves by dynamic programming over their subsets and puts it in
+// place, reusing the treelet's interior nodes. Returns whether the treelet changed
+bool BVHAccel::restructureTreelet(BVHBuildNode* treeletRoot)
+{
+    const int maxLeaves = OPTIMIZE_TREELET_LEAVES;
+    BVHBuildNode* leaves[maxLeaves];
+    BVHBuildNode* interiors[maxLeaves - 1];
+    int leafCount = 0, interiorCount = 0;
+    interiors[interiorCount++] = treeletRoot;
+    leaves[leafCount++] = treeletRoot->left;
+    leaves[leafCount++] = treeletRoot->right;
+    while (leafCount < maxLeaves)
     {
-        bounds = Union(bounds, objects[i]->getBounds());
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < leafCount; ++i)
+        {
+            float area = leaves[i]->bounds.SurfaceArea();
+            if (leaves[i]->left != nullptr && area > largestArea)
+            {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        BVHBuildNode* opened = leaves[largest];
+        interiors[interiorCount++] = opened;
+        leaves[largest] = opened->left;
+        leaves[leafCount++] = opened->right;
     }
+    if (leafCount < 3)//two leaves only have one tree
+        return false;
 
-    if (objects.size() == 1) //ֻһ壬Ϊӽڵ
+    // subsets of the leaves as bit masks, every proper subset of s is numbered below s
+    int subsetCount = 1 << leafCount;
+    Bounds3 subsetBounds[1 << maxLeaves];
+    float cost[1 << maxLeaves];
+    int bestPartition[1 << maxLeaves];
+    for (int s = 1; s < subsetCount; ++s)
     {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
+        int lowest = s & -s;
+        int leaf = 0;
+        while ((1 << leaf) != lowest)
+            ++leaf;
+        if (s == lowest)
+        {
+            subsetBounds[s] = leaves[leaf]->bounds;
+            cost[s] = leaves[leaf]->cost;
+            continue;
+        }
+        subsetBounds[s] = Union(subsetBounds[s ^ lowest], leaves[leaf]->bounds);
+        // each split once: the side holding the lowest leaf
+        float best = std::numeric_limits<float>::infinity();
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+        {
+            if (!(p & lowest))
+                continue;
+            float c = cost[p] + cost[s ^ p];
+            if (c < best)
+            {
+                best = c;
+                bestPartition[s] = p;
+            }
+        }
+        cost[s] = SAH_TRAVERSAL_COST * subsetBounds[s].SurfaceArea() + best;
     }
-    else if (objects.size() == 2) //ֻʣ壬ֱӷΪҲɻֵ
+    int all = subsetCount - 1;
+    // a relative margin, so float noise does not count as a gain
+    if (!(cost[all] < treeletRoot->cost * (1.0f - 1e-5f)))
+        return false;
+
+    // rebuild top down, the root keeps its place in its parent
+    int nextInterior = 1;
+    auto place = [&](auto& self, BVHBuildNode* node, int s) -> void {
+        int sides[2] = { bestPartition[s], s ^ bestPartition[s] };
+        BVHBuildNode* children[2];
+        for (int k = 0; k < 2; ++k)
+        {
+            if ((sides[k] & (sides[k] - 1)) == 0)
+            {
+                int leaf = 0;
+                while ((1 << leaf) != sides[k])
+                    ++leaf;
+                children[k] = leaves[leaf];
+            }
+            else
+            {
+                children[k] = interiors[nextInterior++];
+                self(self, children[k], sides[k]);
+            }
+        }
+        node->left = children[0];
+        node->right = children[1];
+        node->bounds = subsetBounds[s];
+        node->cost = cost[s];
+        node->splitAxis = node->bounds.getMaxExtentDimensionIndex();
+    };
+    place(place, treeletRoot, all);
+    return true;
+}
+
+// 2^exponent built from its bits, the traversal does this per node and axis
+static float exponentScale(int exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// the same float operations as the traversal's decoding, so what the encoder checks is what rays see
+static float dequantize(float origin, float scale, int q)
+{
+    return origin + (float)q * scale;
+}
+
+void BVHAccel::compressNodes()
+{
+    nodesCompressed = true;
+    if (wideNodes.empty())
+        return;
+    double exactCost = computeWideSAHCost();
+    quantizeNodes();
+    double quantizedCost = computeWideSAHCost();
+    printf("Compressed BVH%i nodes: %i x %i bytes, %i bytes instead of %i, SAH cost of the rounded boxes: %.3f (%+.2f%%)\n\n",
+        SIMD_WIDTH, (int)compressedNodes.size(), (int)sizeof(BVHCompressedNode),
+        (int)(compressedNodes.size() * sizeof(BVHCompressedNode)), (int)(compressedNodes.size() * sizeof(BVHWideNode)),
+        quantizedCost, 100.0 * (quantizedCost / exactCost - 1.0));
+}
+
+// wideNodes into compressedNodes, wideNodes are freed afterwards
+void BVHAccel::quantizeNodes()
+{
+    compressedNodes.resize(wideNodes.size());
+    for (size_t i = 0; i < wideNodes.size(); ++i)
     {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+        const BVHWideNode& node = wideNodes[i];
+        BVHCompressedNode& compressed = compressedNodes[i];
+        compressed.childCount = (uint8_t)node.childCount;
+        for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        {
+            compressed.child[lane] = node.child[lane];
+            compressed.nPrimitives[lane] = node.nPrimitives[lane];
+        }
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            // the frame is the node's own box, the union of its children
+            float lo = std::numeric_limits<float>::infinity(), hi = -std::numeric_limits<float>::infinity();
+            for (int lane = 0; lane < node.childCount; ++lane)
+            {
+                lo = std::min(lo, node.boundsMin[dim][lane]);
+                hi = std::max(hi, node.boundsMax[dim][lane]);
+            }
+            // the smallest power of two step that reaches across the frame in 255 steps
+            int exponent = 0;
+            std::frexp((hi - lo) / 255.0f, &exponent);
+            exponent = std::max(-126, std::min(exponent, 127));
+            while (exponent < 127 && dequantize(lo, exponentScale(exponent), 255) < hi)
+                ++exponent;
+            float scale = exponentScale(exponent);
+            compressed.origin[dim] = lo;
+            compressed.scaleExponent[dim] = (int8_t)exponent;
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+            for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+            {
+                if (lane >= node.childCount)//an inverted box, childCount masks the lane out anyway
+                {
+                    compressed.quantizedMin[dim][lane] = 255;
+                    compressed.quantizedMax[dim][lane] = 0;
+                    continue;
+                }
+                float childMin = node.boundsMin[dim][lane], childMax = node.boundsMax[dim][lane];
+                int qMin = std::max(0, std::min((int)std::floor((childMin - lo) / scale), 255));
+                int qMax = std::max(0, std::min((int)std::ceil((childMax - lo) / scale), 255));
+                // the division and the decoding round, step outwards until the decoded box holds the child's
+                while (qMin > 0 && dequantize(lo, scale, qMin) > childMin)
+                    --qMin;
+                while (qMax < 255 && dequantize(lo, scale, qMax) < childMax)
+                    ++qMax;
+                compressed.quantizedMin[dim][lane] = (uint8_t)qMin;
+                compressed.quantizedMax[dim][lane] = (uint8_t)qMax;
+            }
+        }
     }
-    else
+
+    std::vector<BVHWideNode>().swap(wideNodes);
+}
+
+// wide nodes with the rounded boxes, refit recomputes every box from the primitives anyway
+void BVHAccel::decompressNodes()
+{
+    wideNodes.resize(compressedNodes.size());
+    for (size_t i = 0; i < compressedNodes.size(); ++i)
+    {
+        const BVHCompressedNode& compressed = compressedNodes[i];
+        BVHWideNode& node = wideNodes[i];
+        node.childCount = compressed.childCount;
+        for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        {
+            node.child[lane] = compressed.child[lane];
+            node.nPrimitives[lane] = compressed.nPrimitives[lane];
+            for (int dim = 0; dim < 3; ++dim)
+            {
+                float scale = exponentScale(compressed.scaleExponent[dim]);
+                bool used = lane < compressed.childCount;
+                node.boundsMin[dim][lane] = used ? dequantize(compressed.origin[dim], scale, compressed.quantizedMin[dim][lane])
+                                                 : std::numeric_limits<float>::infinity();
+                node.boundsMax[dim][lane] = used ? dequantize(compressed.origin[dim], scale, compressed.quantizedMax[dim][lane])
+                                                 : -std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    std::vector<BVHCompressedNode>().swap(compressedNodes);
+}
+
+bool BVHAccel::refit(float rebuildCostRatio)
+{
+    // compressed nodes are refitted as wide nodes and compressed again, the memory is back to two formats meanwhile
+    if (nodesCompressed)
+        decompressNodes();
+    if (wideNodes.empty())
+        return false;
+    int threadCount = hardwareThreads();
+#ifdef RECORD_RAY_HIT_PATH
+    threadCount = 1;
+#endif
+
+    if (refitOrder.empty())
     {
-        Bounds3 centroidBounds;//ȡµж󼸺ĵһAABB߽
-        for (int i = 0; i < objects.size(); ++i)
+        // children come after their parent, so one pass front to back finds every node's depth
+        std::vector<int> depth(wideNodes.size(), 0);
+        int maxDepth = 0;
+        for (size_t i = 0; i < wideNodes.size(); ++i)
         {
-            centroidBounds = Union(centroidBounds, objects[i]->getBounds().Centroid());
+            const BVHWideNode& node = wideNodes[i];
+            for (int lane = 0; lane < node.childCount; ++lane)
+            {
+                if (node.nPrimitives[lane] == 0)
+                {
+                    depth[node.child[lane]] = depth[i] + 1;
+                    maxDepth = std::max(maxDepth, depth[i] + 1);
+                }
+            }
         }
-        
-        int dimIndex = centroidBounds.getMaxExtentDimensionIndex();
-        switch (dimIndex) //򳡾
+        refitLevelStart.assign(maxDepth + 2, 0);
+        for (int d : depth)
         {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x < f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y < f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z < f2->getBounds().Centroid().z;
+            refitLevelStart[maxDepth - d + 1]++;
+        }
+        for (int level = 1; level <= maxDepth + 1; ++level)
+        {
+            refitLevelStart[level] += refitLevelStart[level - 1];
+        }
+        std::vector<int> next(refitLevelStart.begin(), refitLevelStart.end() - 1);
+        refitOrder.resize(wideNodes.size());
+        for (size_t i = 0; i < wideNodes.size(); ++i)
+        {
+            refitOrder[next[maxDepth - depth[i]]++] = (int)i;
+        }
+    }
+
+    // the triangle blocks of the leaves first, then the wide nodes a level at a time from the bottom
+    if (packedTriangles)
+    {
+        parallelForChunks((int)triangleBlocks.size(), REFIT_CHUNK_SIZE, threadCount, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+                refitTriangleBlock(triangleBlocks[i]);
+        });
+    }
+    for (size_t level = 0; level + 1 < refitLevelStart.size(); ++level)
+    {
+        const int* levelNodes = refitOrder.data() + refitLevelStart[level];
+        parallelForChunks(refitLevelStart[level + 1] - refitLevelStart[level], REFIT_CHUNK_SIZE, threadCount,
+            [&](int begin, int end) {
+                for (int i = begin; i < end; ++i)
+                    refitWideNode(levelNodes[i]);
             });
-            break;
+    }
+    if (root)
+    {
+        refitBuildTree(root, threadCount - 1);
+    }
+
+    // moved primitives leave boxes that overlap more and more, past some point a new tree pays for itself
+    currentSAHCost = computeWideSAHCost();
+    if (currentSAHCost > rebuildCostRatio * builtSAHCost)
+    {
+        rebuild();
+        return true;
+    }
+    if (nodesCompressed)
+        quantizeNodes();
+    return false;
+}
+
+void BVHAccel::rebuild()
+{
+    int primitiveCount = (int)(mesh ? meshTriangleCount : primitives.size());
+    deleteBuildTree(root);
+    root = nullptr;
+    wideNodes.clear();
+    compressedNodes.clear();
+    triangleBlocks.clear();
+    refitOrder.clear();
+    refitLevelStart.clear();
+    build(gatherPrimitiveInfo(primitiveCount));
+    if (nodesCompressed)
+        compressNodes();
+}
+
+void BVHAccel::refitTriangleBlock(TriangleBlock& block) const
+{
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+    {
+        if (block.primitive[lane] < 0)//unused lanes keep their zero edges
+            continue;
+        Vector3f v0, v1, v2;
+        getTriangle(block.primitive[lane], v0, v1, v2);
+        Vector3f e1 = v1 - v0, e2 = v2 - v0;
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            block.v0[dim][lane] = axisOf(v0, dim);
+            block.e1[dim][lane] = axisOf(e1, dim);
+            block.e2[dim][lane] = axisOf(e2, dim);
+        }
+    }
+}
+
+static Bounds3 laneBounds(const BVHWideNode& node, int lane)
+{
+    Bounds3 bounds;
+    bounds.pMin = Vector3f(node.boundsMin[0][lane], node.boundsMin[1][lane], node.boundsMin[2][lane]);
+    bounds.pMax = Vector3f(node.boundsMax[0][lane], node.boundsMax[1][lane], node.boundsMax[2][lane]);
+    return bounds;
+}
+
+static Bounds3 laneBounds(const BVHCompressedNode& node, int lane)
+{
+    float lo[3], hi[3];
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        float scale = exponentScale(node.scaleExponent[dim]);
+        lo[dim] = dequantize(node.origin[dim], scale, node.quantizedMin[dim][lane]);
+        hi[dim] = dequantize(node.origin[dim], scale, node.quantizedMax[dim][lane]);
+    }
+    Bounds3 bounds;
+    bounds.pMin = Vector3f(lo[0], lo[1], lo[2]);
+    bounds.pMax = Vector3f(hi[0], hi[1], hi[2]);
+    return bounds;
+}
+
+// the children's boxes from the primitives or from the child nodes, which are already refitted
+void BVHAccel::refitWideNode(int index)
+{
+    BVHWideNode& node = wideNodes[index];
+    for (int lane = 0; lane < node.childCount; ++lane)
+    {
+        float lo[3], hi[3];
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            lo[dim] = std::numeric_limits<float>::infinity();
+            hi[dim] = -std::numeric_limits<float>::infinity();
+        }
+        int child = node.child[lane];
+        if (node.nPrimitives[lane] == 0)
+        {
+            // unused lanes hold inverted boxes, so all of them can be folded in
+            const BVHWideNode& childNode = wideNodes[child];
+            for (int dim = 0; dim < 3; ++dim)
+            {
+                for (int childLane = 0; childLane < SIMD_WIDTH; ++childLane)
+                {
+                    lo[dim] = std::min(lo[dim], childNode.boundsMin[dim][childLane]);
+                    hi[dim] = std::max(hi[dim], childNode.boundsMax[dim][childLane]);
+                }
+            }
+        }
+        else if (packedTriangles)
+        {
+            // from the refitted blocks, which sit together, instead of gathering the vertices once more.
+            // v0 + e1 can be an ulp off v1, but it is the corner the intersection kernel tests
+            for (int b = 0; b < node.nPrimitives[lane]; b += SIMD_WIDTH)
+            {
+                const TriangleBlock& block = triangleBlocks[child + b / SIMD_WIDTH];
+                for (int blockLane = 0; blockLane < SIMD_WIDTH && block.primitive[blockLane] >= 0; ++blockLane)
+                {
+                    for (int dim = 0; dim < 3; ++dim)
+                    {
+                        float v0 = block.v0[dim][blockLane];
+                        float v1 = v0 + block.e1[dim][blockLane], v2 = v0 + block.e2[dim][blockLane];
+                        lo[dim] = std::min(lo[dim], std::min(v0, std::min(v1, v2)));
+                        hi[dim] = std::max(hi[dim], std::max(v0, std::max(v1, v2)));
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (int i = 0; i < node.nPrimitives[lane]; ++i)
+            {
+                Bounds3 bounds = primitives[child + i]->getBounds();
+                for (int dim = 0; dim < 3; ++dim)
+                {
+                    lo[dim] = std::min(lo[dim], axisOf(bounds.pMin, dim));
+                    hi[dim] = std::max(hi[dim], axisOf(bounds.pMax, dim));
+                }
+            }
+        }
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            node.boundsMin[dim][lane] = lo[dim];
+            node.boundsMax[dim][lane] = hi[dim];
+        }
+    }
+}
+
+// the build tree is not traversed, but optimize and the recorded hit path walk its boxes
+void BVHAccel::refitBuildTree(BVHBuildNode* node, int spareThreads)
+{
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        node->bounds = Bounds3();
+        for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i)
+        {
+            if (mesh)
+            {
+                Vector3f v0, v1, v2;
+                getTriangle(i, v0, v1, v2);
+                node->bounds = Union(Union(Union(node->bounds, v0), v1), v2);
+            }
+            else
+            {
+                node->bounds = Union(node->bounds, primitives[i]->getBounds());
+            }
+        }
+        return;
+    }
+    if (spareThreads > 0 && countPrimitives(node, PARALLEL_BUILD_CUTOFF) >= PARALLEL_BUILD_CUTOFF)
+    {
+        int leftThreads = (spareThreads - 1) / 2;
+        std::thread leftRefitter([&]() { refitBuildTree(node->left, leftThreads); });
+        refitBuildTree(node->right, spareThreads - 1 - leftThreads);
+        leftRefitter.join();
+    }
+    else
+    {
+        refitBuildTree(node->left, 0);
+        refitBuildTree(node->right, 0);
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+}
+
+// computeSAHCost for the wide tree, each wide node is one traversal step
+template <typename WideNode>
+static double wideSAHCost(const std::vector<WideNode>& wideNodes)
+{
+    if (wideNodes.empty())
+        return 0.0;
+    Bounds3 rootBounds;
+    for (int lane = 0; lane < wideNodes[0].childCount; ++lane)
+    {
+        rootBounds = Union(rootBounds, laneBounds(wideNodes[0], lane));
+    }
+    double rootArea = rootBounds.SurfaceArea();
+    double cost = SAH_TRAVERSAL_COST;
+    for (const WideNode& node : wideNodes)
+    {
+        for (int lane = 0; lane < node.childCount; ++lane)
+        {
+            double areaRatio = rootArea > 0.0 ? laneBounds(node, lane).SurfaceArea() / rootArea : 1.0;
+            cost += (node.nPrimitives[lane] > 0 ? node.nPrimitives[lane] : SAH_TRAVERSAL_COST) * areaRatio;
         }
+    }
+    return cost;
+}
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+double BVHAccel::computeWideSAHCost() const
+{
+    return wideNodes.empty() ? wideSAHCost(compressedNodes) : wideSAHCost(wideNodes);
+}
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+void BVHAccel::getTriangle(int primitive, Vector3f& v0, Vector3f& v1, Vector3f& v2) const
+{
+    const uint32_t* index = meshVertexIndex + triangles[primitive] * 3;
+    v0 = meshVertices[index[0]];
+    v1 = meshVertices[index[1]];
+    v2 = meshVertices[index[2]];
+}
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+// same result Triangle::getIntersection builds, the hit belongs to the mesh
+Intersection BVHAccel::getTriangleIntersection(int primitive, const Ray& ray, float tHit) const
+{
+    Vector3f v0, v1, v2;
+    getTriangle(primitive, v0, v1, v2);
+    Intersection isect;
+    isect.happened = true;
+    isect.distance = tHit;
+    isect.pMaterial = meshMaterial;
+    isect.obj = mesh;
+    isect.triangleIndex = (int)triangles[primitive];
+    isect.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+    isect.coords = ray(tHit);
+    return isect;
+}
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+// Ray data broadcast to every lane once per traversal
+struct WideRay
+{
+    SimdFloat origin[3];
+    SimdFloat dir[3];
+    SimdFloat invDir[3];
+    int dirIsNeg[3];
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    WideRay(const Ray& ray)
+    {
+        origin[0] = ray.origin.x; origin[1] = ray.origin.y; origin[2] = ray.origin.z;
+        dir[0] = ray.direction.x; dir[1] = ray.direction.y; dir[2] = ray.direction.z;
+        invDir[0] = ray.direction_inv.x; invDir[1] = ray.direction_inv.y; invDir[2] = ray.direction_inv.z;
+        dirIsNeg[0] = ray.direction_inv.x < 0.0f;
+        dirIsNeg[1] = ray.direction_inv.y < 0.0f;
+        dirIsNeg[2] = ray.direction_inv.z < 0.0f;
     }
+};
 
-    return node;
+// Slab test against all children of a wide node at once, the same test as Bounds3::IntersectP.
+// Returns the hit lanes as a bit mask and every lane's entry distance in tEnter
+static int intersectWideNode(const BVHWideNode& node, const WideRay& wideRay, float tMin, float tMax, float* tEnter)
+{
+    SimdFloat enter = tMin, exit = tMax;
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        const float* nearPlanes = wideRay.dirIsNeg[dim] ? node.boundsMax[dim] : node.boundsMin[dim];
+        const float* farPlanes = wideRay.dirIsNeg[dim] ? node.boundsMin[dim] : node.boundsMax[dim];
+        enter = max(enter, (SimdFloat::load(nearPlanes) - wideRay.origin[dim]) * wideRay.invDir[dim]);
+        exit = min(exit, (SimdFloat::load(farPlanes) - wideRay.origin[dim]) * wideRay.invDir[dim]);
+    }
+    enter.store(tEnter);
+    return (enter <= exit).bits() & ((1 << node.childCount) - 1);
+}
+
+// the same test with the boxes decoded first, as laneBounds does for BVHCompressedNode
+static int intersectWideNode(const BVHCompressedNode& node, const WideRay& wideRay, float tMin, float tMax, float* tEnter)
+{
+    SimdFloat enter = tMin, exit = tMax;
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        SimdFloat origin = node.origin[dim], scale = exponentScale(node.scaleExponent[dim]);
+        SimdFloat lo = origin + SimdFloat::loadBytes(node.quantizedMin[dim]) * scale;
+        SimdFloat hi = origin + SimdFloat::loadBytes(node.quantizedMax[dim]) * scale;
+        SimdFloat tLo = (lo - wideRay.origin[dim]) * wideRay.invDir[dim];
+        SimdFloat tHi = (hi - wideRay.origin[dim]) * wideRay.invDir[dim];
+        enter = max(enter, wideRay.dirIsNeg[dim] ? tHi : tLo);
+        exit = min(exit, wideRay.dirIsNeg[dim] ? tLo : tHi);
+    }
+    enter.store(tEnter);
+    return (enter <= exit).bits() & ((1 << node.childCount) - 1);
+}
+
+// rayTriangleIntersect_MollerTrumbore on a whole block: same culling and ranges, one lane per triangle.
+// Returns the lanes hit inside [tMin, tMax] as a bit mask and every lane's distance in tHit
+static int intersectTriangleBlock(const TriangleBlock& block, const WideRay& wideRay, float tMin, float tMax, float* tHit)
+{
+    SimdFloat e1x = SimdFloat::load(block.e1[0]), e1y = SimdFloat::load(block.e1[1]), e1z = SimdFloat::load(block.e1[2]);
+    SimdFloat e2x = SimdFloat::load(block.e2[0]), e2y = SimdFloat::load(block.e2[1]), e2z = SimdFloat::load(block.e2[2]);
+    const SimdFloat* dir = wideRay.dir;
+
+    // S1 = dir x E2, det = E1 . S1
+    SimdFloat s1x = dir[1] * e2z - dir[2] * e2y;
+    SimdFloat s1y = dir[2] * e2x - dir[0] * e2z;
+    SimdFloat s1z = dir[0] * e2y - dir[1] * e2x;
+    SimdFloat det = e1x * s1x + e1y * s1y + e1z * s1z;
+    SimdFloat invDet = SimdFloat(1.0f) / det;
+
+    // S = orig - v0, S2 = S x E1
+    SimdFloat sx = wideRay.origin[0] - SimdFloat::load(block.v0[0]);
+    SimdFloat sy = wideRay.origin[1] - SimdFloat::load(block.v0[1]);
+    SimdFloat sz = wideRay.origin[2] - SimdFloat::load(block.v0[2]);
+    SimdFloat s2x = sy * e1z - sz * e1y;
+    SimdFloat s2y = sz * e1x - sx * e1z;
+    SimdFloat s2z = sx * e1y - sy * e1x;
+
+    SimdFloat t = (e2x * s2x + e2y * s2y + e2z * s2z) * invDet;
+    SimdFloat u = (sx * s1x + sy * s1y + sz * s1z) * invDet;
+    SimdFloat v = (dir[0] * s2x + dir[1] * s2y + dir[2] * s2z) * invDet;
+
+    SimdFloat zero(0.0f), one(1.0f);
+    SimdMask hit = (det > zero)
+        & (t >= SimdFloat(std::max(tMin, 0.0f))) & (t <= SimdFloat(tMax))
+        & (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one);
+    t.store(tHit);
+    return hit.bits();
+}
+
+// what the wide traversal still has to visit: a wide node, or a leaf's primitive range when nPrimitives > 0
+struct WideStackEntry
+{
+    int index;
+    int nPrimitives;
+    float tEnter;
+};
+static const int WIDE_STACK_SIZE = 64 * SIMD_WIDTH;
+
+// The fixed array covers every balanced tree. Nothing bounds the depth of a SAH, SBVH or optimized tree over
+// a degenerate mesh though, so entries past it spill into a vector instead of overrunning the array
+struct WideStack
+{
+    WideStackEntry entries[WIDE_STACK_SIZE];
+    std::vector<WideStackEntry> spilled;
+    int count = 0;
+
+    bool empty() const { return count == 0; }
+    void push(const WideStackEntry& entry)
+    {
+        if (count < WIDE_STACK_SIZE)
+            entries[count] = entry;
+        else
+            spilled.push_back(entry);
+        ++count;
+    }
+    WideStackEntry pop()
+    {
+        if (--count < WIDE_STACK_SIZE)
+            return entries[count];
+        WideStackEntry entry = spilled.back();
+        spilled.pop_back();
+        return entry;
+    }
+};
+
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    if (wideNodes.empty() && compressedNodes.empty())
+        return false;
+
+    // occlusion only needs to know that something blocks the segment, so stop at the first primitive hit
+    WideRay wideRay(ray);
+    float tEnter[SIMD_WIDTH], tHit[SIMD_WIDTH];
+    WideStack toVisit;
+    toVisit.push({ 0, 0, (float)ray.t_min });
+    while (!toVisit.empty())
+    {
+        WideStackEntry entry = toVisit.pop();
+        if (entry.nPrimitives > 0 && packedTriangles)
+        {
+            for (int b = 0; b < entry.nPrimitives; b += SIMD_WIDTH)
+            {
+                if (intersectTriangleBlock(triangleBlocks[entry.index + b / SIMD_WIDTH], wideRay,
+                                           (float)ray.t_min, (float)ray.t_max, tHit))
+                    return true;
+            }
+            continue;
+        }
+        if (entry.nPrimitives > 0)
+        {
+            for (int i = 0; i < entry.nPrimitives; ++i)
+            {
+                if (primitives[entry.index + i]->intersect(ray))
+                    return true;
+            }
+            continue;
+        }
+
+        auto visitChildren = [&](const auto& node) {
+            int hitMask = intersectWideNode(node, wideRay, (float)ray.t_min, (float)ray.t_max, tEnter);
+            for (int lane = 0; lane < node.childCount; ++lane)
+            {
+                if (hitMask & (1 << lane))
+                {
+                    toVisit.push({ node.child[lane], node.nPrimitives[lane], tEnter[lane] });
+                }
+            }
+        };
+        if (nodesCompressed)
+            visitChildren(compressedNodes[entry.index]);
+        else
+            visitChildren(wideNodes[entry.index]);
+    }
+    return false;
 }
 
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
     Intersection isect;
-    if (!root)
+    if (wideNodes.empty() && compressedNodes.empty())
         return isect;
+#ifdef RECORD_RAY_HIT_PATH
     isect = BVHAccel::getIntersection(root, ray);
     return isect;
+#else
+    // t_max shrinks to the closest hit found so far, so children and primitives behind it are skipped
+    Ray clippedRay = ray;
+    WideRay wideRay(ray);
+    float tEnter[SIMD_WIDTH], tHit[SIMD_WIDTH];
+    int hitTriangle = -1;//closest packed triangle, turned into an Intersection once traversal is done
+    float hitDistance = 0.0f;
+    WideStack toVisit;
+    toVisit.push({ 0, 0, (float)ray.t_min });
+    while (!toVisit.empty())
+    {
+        WideStackEntry entry = toVisit.pop();
+        if (entry.tEnter > clippedRay.t_max)//a closer hit was found after this entry was pushed
+            continue;
+
+        if (entry.nPrimitives > 0 && packedTriangles)
+        {
+            for (int b = 0; b < entry.nPrimitives; b += SIMD_WIDTH)
+            {
+                const TriangleBlock& block = triangleBlocks[entry.index + b / SIMD_WIDTH];
+                int hitMask = intersectTriangleBlock(block, wideRay, (float)clippedRay.t_min, (float)clippedRay.t_max, tHit);
+                for (int lane = 0; hitMask != 0; ++lane, hitMask >>= 1)
+                {
+                    if ((hitMask & 1) && tHit[lane] < clippedRay.t_max)
+                    {
+                        hitTriangle = block.primitive[lane];
+                        hitDistance = tHit[lane];
+                        clippedRay.t_max = hitDistance;
+                    }
+                }
+            }
+            continue;
+        }
+        if (entry.nPrimitives > 0)
+        {
+            for (int i = 0; i < entry.nPrimitives; ++i)
+            {
+                Intersection hit = primitives[entry.index + i]->getIntersection(clippedRay);
+                if (hit.happened && hit.distance < isect.distance)
+                {
+                    isect = hit;
+                    clippedRay.t_max = hit.distance;
+                }
+            }
+            continue;
+        }
+
+        auto visitChildren = [&](const auto& node) {
+            int hitMask = intersectWideNode(node, wideRay, (float)clippedRay.t_min, (float)clippedRay.t_max, tEnter);
+
+            // sort the hit children near to far, then push them far to near so the nearest is popped first
+            int order[SIMD_WIDTH];
+            int hitCount = 0;
+            for (int lane = 0; lane < node.childCount; ++lane)
+            {
+                if (!(hitMask & (1 << lane)))
+                    continue;
+                int k = hitCount++;
+                while (k > 0 && tEnter[order[k - 1]] > tEnter[lane])
+                {
+                    order[k] = order[k - 1];
+                    --k;
+                }
+                order[k] = lane;
+            }
+            for (int k = hitCount - 1; k >= 0; --k)
+            {
+                int lane = order[k];
+                toVisit.push({ node.child[lane], node.nPrimitives[lane], tEnter[lane] });
+            }
+        };
+        if (nodesCompressed)
+            visitChildren(compressedNodes[entry.index]);
+        else
+            visitChildren(wideNodes[entry.index]);
+    }
+
+    if (hitTriangle >= 0)
+    {
+        isect = getTriangleIntersection(hitTriangle, ray, hitDistance);
+    }
+    return isect;
+#endif
 }
 
 Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
@@ -126,7 +1946,32 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     //Ҷӽڵ㣬ģϸж
     if (node->left == nullptr && node->right == nullptr)
     {
-        return node->object->getIntersection(ray);//ʵ
+        //ʵ
+        Intersection closest;
+        for (int i = 0; i < node->nPrimitives; ++i)
+        {
+            Intersection hit;
+            if (mesh)
+            {
+                Vector3f v0, v1, v2;
+                float t, u, v;
+                getTriangle(node->firstPrimOffset + i, v0, v1, v2);
+                if (rayTriangleIntersect_MollerTrumbore(v0, v1 - v0, v2 - v0, ray.origin, ray.direction, t, u, v)
+                    && t <= ray.t_max)
+                {
+                    hit = getTriangleIntersection(node->firstPrimOffset + i, ray, t);
+                }
+            }
+            else
+            {
+                hit = primitives[node->firstPrimOffset + i]->getIntersection(ray);
+            }
+            if (hit.happened && hit.distance < closest.distance)
+            {
+                closest = hit;
+            }
+        }
+        return closest;
     }
     //Χм
     Intersection hitLeft = getIntersection(node->left, ray);
@@ -187,26 +2032,3 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     return hitLeft.distance < hitRight.distance ? hitLeft : hitRight;
 #endif
 }
-
-
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
-    }
-    if (p < node->left->area)
-    {
-        getSample(node->left, p, pos, pdf);
-    }
-    else
-    {
-        getSample(node->right, p - node->left->area, pos, pdf);
-    }
-}
-
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
@@ -6,6 +6,7 @@
 #define RAYTRACING_BVH_H
 
 #include <atomic>
+#include <chrono>
 #include <vector>
 #include <memory>
 #include <ctime>
@@ -14,6 +15,8 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "SIMD.hpp"
+#include "MeshCache.hpp"
 
 #ifdef _DEBUG
 #ifndef RECORD_RAY_HIT_PATH
@@ -28,7 +31,7 @@ public:
     BVHBuildNode* left;
     BVHBuildNode* right;
     Object* object;
-    float area;
+    float cost = 0.0f;//SAH cost of the subtree times its root's area, only optimize keeps it
 
 #ifdef RECORD_RAY_HIT_PATH
     BVHBuildNode* rayHitNodePathLeft;
@@ -44,7 +47,6 @@ public:
         bounds = Bounds3();
         left = nullptr; right = nullptr;
         object = nullptr;
-        area = 0.0f;
 
         //jingz
 #ifdef RECORD_RAY_HIT_PATH
@@ -55,8 +57,66 @@ public:
     }
 };
 
-// BVHAccel Forward Declarations
-struct BVHPrimitiveInfo;
+// Depth-first flattened node: the first child directly follows its parent,
+// the second one is found by offset, a leaf owns a range of BVHAccel::primitives
+struct alignas(32) LinearBVHNode
+{
+    Bounds3 bounds;
+    union
+    {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    uint8_t pad[1];        // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// Collapsed SIMD_WIDTH-ary node (BVH4 with SSE, BVH8 with AVX). The child boxes are stored
+// structure-of-arrays so one SimdFloat slab test covers every child at once
+struct alignas(32) BVHWideNode
+{
+    float boundsMin[3][SIMD_WIDTH];
+    float boundsMax[3][SIMD_WIDTH];
+    int child[SIMD_WIDTH];             // interior child: index into wideNodes, leaf child: first primitive
+    uint16_t nPrimitives[SIMD_WIDTH];  // 0 -> interior child
+    int childCount;                    // children fill lanes [0, childCount)
+};
+
+// BVHWideNode with the child boxes stored as 8 bit steps in the frame of the node's own box:
+// a bound is origin + q * 2^scaleExponent, the minimum rounded down and the maximum up, so boxes only grow.
+// Half the size of a BVHWideNode, 64 bytes with SSE, for scenes where traversal waits on memory
+struct alignas(32) BVHCompressedNode
+{
+    float origin[3];
+    int8_t scaleExponent[3];
+    uint8_t childCount;
+    uint8_t quantizedMin[3][SIMD_WIDTH];
+    uint8_t quantizedMax[3][SIMD_WIDTH];
+    int child[SIMD_WIDTH];
+    uint16_t nPrimitives[SIMD_WIDTH];
+};
+
+// SIMD_WIDTH triangles of one leaf, structure-of-arrays with the edges precomputed.
+// Unused lanes keep zero edges, which the intersection kernel rejects as degenerate
+struct alignas(32) TriangleBlock
+{
+    float v0[3][SIMD_WIDTH];
+    float e1[3][SIMD_WIDTH];  // v1 - v0
+    float e2[3][SIMD_WIDTH];  // v2 - v0
+    int primitive[SIMD_WIDTH];  // index into BVHAccel::triangles
+};
+
+// What the builder needs to know about one primitive, gathered once before the build
+struct BVHPrimitiveInfo
+{
+    int primitiveNumber;  // index into the primitive list or triangle number of the mesh
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+struct SBVHBuildState;
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -64,28 +124,108 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // LBVH cuts at the Morton code bits of the centroids, HLBVH does that below the top 12 bits
+    // and joins the resulting treelets with SAH. SBVH adds spatial splits to SAH, a triangle crossing
+    // the split plane is referenced from both sides; over objects, which can not be clipped, it is SAH
+    enum class SplitMethod { NAIVE, SAH, LBVH, HLBVH, SBVH };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // BVH over the triangles of an indexed mesh, leaves reference them by triangle number.
+    // vertices and vertexIndex are not copied and have to outlive the BVH
+    BVHAccel(Object* mesh, Material* material, const Vector3f* vertices, const uint32_t* vertexIndex,
+             uint32_t numTriangles, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // the same mesh BVH read back from what writeCache stored instead of built, left empty when the cache
+    // does not hold a valid BVH. There is no build tree, so no recorded hit path
+    BVHAccel(Object* mesh, Material* material, const Vector3f* vertices, const uint32_t* vertexIndex,
+             uint32_t numTriangles, int maxPrimsInNode, SplitMethod splitMethod, CacheReader& cache);
+    void writeCache(CacheWriter& cache) const;
+    // Moves every bound to where the primitives are now, after a mesh's vertices changed in place or the objects
+    // moved, keeping the topology. Linear in the tree size and spread over the hardware threads. When the refitted
+    // SAH cost exceeds rebuildCostRatio times the cost after the last build, the tree is rebuilt and true returned
+    bool refit(float rebuildCostRatio = 1.5f);
+    void rebuild();
+    // swaps the wide nodes for BVHCompressedNodes, refit and rebuild keep the format
+    void compressNodes();
+    // Restructures treelets of the build tree for a lower SAH cost, in rounds until timeBudget seconds are
+    // spent or a round stops paying, then collapses the wide nodes again. A tree read from a cache has no
+    // build tree and stays as it is
+    void optimize(double timeBudget);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
+    bool IntersectP(const Ray &ray) const;//any hit inside [ray.t_min, ray.t_max]
     BVHBuildNode* root;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    std::vector<BVHPrimitiveInfo> gatherPrimitiveInfo(int primitiveCount) const;
+    void build(std::vector<BVHPrimitiveInfo> primitiveInfo);
+    // builds primitiveInfo[start, end), reordering it in place; up to spareThreads more threads take large subtrees
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int spareThreads);
+    BVHBuildNode* createLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                             const Bounds3& bounds);
+    bool partitionSAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const Bounds3& bounds,
+                      const Bounds3& centroidBounds, int dim, int& middle) const;
+    double findSAHSplit(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                        const Bounds3& centroidBounds, int dim, int& bestBoundary,
+                        Bounds3& leftBounds, Bounds3& rightBounds) const;
+    BVHBuildNode* buildSBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    BVHBuildNode* recursiveBuildSBVH(std::vector<BVHPrimitiveInfo>& references, SBVHBuildState& state);
+    double findSpatialSplit(const std::vector<BVHPrimitiveInfo>& references, const Bounds3& bounds, int& bestDim,
+                            int& bestPlane, Bounds3& leftBounds, Bounds3& rightBounds, int& duplicates) const;
+    void splitReference(const BVHPrimitiveInfo& reference, int dim, float position,
+                        BVHPrimitiveInfo& left, BVHPrimitiveInfo& right) const;
+    BVHBuildNode* buildMorton(std::vector<BVHPrimitiveInfo>& primitiveInfo, int spareThreads);
+    BVHBuildNode* emitLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo, const std::vector<uint64_t>& mortonCodes,
+                           int start, int end, int bitIndex, int spareThreads);
+    BVHBuildNode* buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, std::vector<BVHPrimitiveInfo>& treeletInfo,
+                                int start, int end);
+    double computeSAHCost(BVHBuildNode* node, double rootArea, int& interiorCount, int& leafCount) const;
+    int flattenBVHTree(BVHBuildNode* node, int& offset);
+    void buildWideTree(int interiorCount, int leafCount, int primitiveCount);
+    bool optimizeSubtree(BVHBuildNode* node, int spareThreads, std::chrono::steady_clock::time_point deadline,
+                         std::atomic<int>& restructured);
+    bool restructureTreelet(BVHBuildNode* treeletRoot);
+    int collapseWideNode(int linearIndex);
+    int packTriangleLeaf(int primitivesOffset, int nPrimitives);
+    void getTriangle(int primitive, Vector3f& v0, Vector3f& v1, Vector3f& v2) const;
+    Intersection getTriangleIntersection(int primitive, const Ray& ray, float tHit) const;
+    bool readCache(CacheReader& cache, uint32_t numTriangles);
+    void quantizeNodes();
+    void decompressNodes();
+    void refitTriangleBlock(TriangleBlock& block) const;
+    void refitWideNode(int index);
+    void refitBuildTree(BVHBuildNode* node, int spareThreads);
+    double computeWideSAHCost() const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
-    std::vector<Object*> primitives;
+    std::vector<Object*> primitives;//leaf primitives, in leaf order once the build is done
+    // indexed mesh the BVH was built over, null for a BVH over objects
+    Object* mesh = nullptr;
+    Material* meshMaterial = nullptr;
+    const Vector3f* meshVertices = nullptr;
+    const uint32_t* meshVertexIndex = nullptr;
+    uint32_t meshTriangleCount = 0;
+    std::vector<uint32_t> triangles;//mesh triangle numbers in leaf order, an SBVH repeats the split ones
+    std::vector<LinearBVHNode> nodes;//binary tree in depth-first order, only alive while buildWideTree collapses it; root is what optimize and hit path debugging use
+    std::vector<BVHWideNode> wideNodes;//what Intersect and IntersectP walk, collapsed from nodes
+    std::vector<BVHCompressedNode> compressedNodes;//walked instead once compressNodes freed wideNodes
+    bool nodesCompressed = false;
+    bool packedTriangles = false;//built over a mesh, wide leaves then point at triangleBlocks
+    std::vector<TriangleBlock> triangleBlocks;
+    // wide nodes grouped by depth, deepest first, so refit finishes a level before the one above reads it
+    std::vector<int> refitOrder;
+    std::vector<int> refitLevelStart;
+    double builtSAHCost = 0.0;//of the wide tree right after the build, what refit compares against
+    double currentSAHCost = 0.0;//of the wide tree as it is now
+    // what the spatial splits of an SBVH build did, for the build stats
+    int spatialSplits = 0;
+    int duplicatedReferences = 0;
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
 };
 
 #endif //RAYTRACING_BVH_H
@@ -142,7 +142,8 @@ inline bool Bounds3::IntersectP(const Ray& ray) const
     float tEnter = std::max(t_Min_x, std::max(t_Min_y, t_Min_z));
     float tExit = std::min(t_Max_x, std::min(t_Max_y, t_Max_z));
 
-    if (tExit >= 0 && tEnter <= tExit)
+    // only the part of the ray inside [t_min, t_max] counts, so boxes behind the closest hit so far are rejected
+    if (tExit >= 0 && tEnter <= tExit && tExit >= ray.t_min && tEnter <= ray.t_max)
         return true;
 
     return false;
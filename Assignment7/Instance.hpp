@@ -0,0 +1,143 @@
+//
+// A MeshTriangle placed in the scene by a transform. Any number of instances share the mesh's vertices
+// and BVH, the scene BVH sees each instance as one primitive and rays move into mesh space at its leaves.
+//
+
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include <vector>
+#include "AliasTable.hpp"
+#include "Object.hpp"
+#include "Transform.hpp"
+#include "Triangle.hpp"
+
+// Rays are tested in mesh space, so the mesh decides which faces get culled. Normals come back through
+// the inverse transpose and keep facing the rays that hit them; a mirroring transform flips the winding
+// of the world space triangles instead, worldTriangle undoes that for code that takes normals from edges
+class Instance : public Object
+{
+public:
+    // material null keeps the mesh's
+    Instance(MeshTriangle* mesh, const Transform& toWorld, Material* material = nullptr)
+        : mesh(mesh), pMaterial(material ? material : mesh->pMaterial)
+    {
+        setTransform(toWorld);
+    }
+
+    // also to be called after the mesh was refitted. The scene BVH has to be refitted afterwards
+    void setTransform(const Transform& transform)
+    {
+        toWorld = transform;
+        toObject = transform.inverse();
+        mirrored = toWorld.determinant() < 0.0f;
+        worldBounds = toWorld.bounds(mesh->getBounds());
+
+        // a non-uniform scale changes triangles' areas by different factors, so they are measured again
+        std::vector<float> triangleAreas(mesh->numTriangles);
+        area = 0.0f;
+        for (uint32_t k = 0; k < mesh->numTriangles; ++k)
+        {
+            Vector3f v0, v1, v2;
+            worldTriangle(k, v0, v1, v2);
+            triangleAreas[k] = crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+            area += triangleAreas[k];
+        }
+        if (pMaterial->hasEmission())
+        {
+            triangleDistribution.build(triangleAreas);
+        }
+    }
+
+    // triangle k of the mesh in world space, wound so its edges' cross product is the normal hits report
+    void worldTriangle(uint32_t k, Vector3f& v0, Vector3f& v1, Vector3f& v2) const
+    {
+        v0 = toWorld.point(mesh->vertices[mesh->vertexIndex[k * 3]]);
+        v1 = toWorld.point(mesh->vertices[mesh->vertexIndex[k * 3 + 1]]);
+        v2 = toWorld.point(mesh->vertices[mesh->vertexIndex[k * 3 + 2]]);
+        if (mirrored)
+            std::swap(v1, v2);
+    }
+
+    // The direction is not normalized, so distances along the ray, t_min and t_max included, stay the same
+    Ray toObjectRay(const Ray& ray) const
+    {
+        Ray objectRay(toObject.point(ray.origin), toObject.vector(ray.direction), ray.t);
+        objectRay.t_min = ray.t_min;
+        objectRay.t_max = ray.t_max;
+        return objectRay;
+    }
+
+    Vector3f toWorldNormal(const Vector3f& n) const
+    {
+        return normalize(toObject.transposedVector(n));
+    }
+
+    bool intersect(const Ray& ray) { return mesh->intersect(toObjectRay(ray)); }
+
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
+    {
+        return mesh->intersect(toObjectRay(ray), tnear, index);
+    }
+
+    Intersection getIntersection(Ray ray)
+    {
+        Intersection isect = mesh->getIntersection(toObjectRay(ray));
+        if (!isect.happened)
+            return isect;
+        isect.coords = ray(isect.distance);
+        isect.normal = toWorldNormal(isect.normal);
+        isect.obj = this;
+        isect.pMaterial = pMaterial;
+        return isect;
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const
+    {
+        mesh->getSurfaceProperties(toObject.point(P), toObject.vector(I), index, uv, N, st);
+        N = toWorldNormal(N);
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f& st) const { return mesh->evalDiffuseColor(st); }
+
+    Bounds3 getBounds() { return worldBounds; }
+
+    // uniform over the instance's world space area, as MeshTriangle::Sample over the mesh
+    void Sample(Intersection &pos, float &pdf)
+    {
+        float pmf = 0.0f;
+        float u1 = get_random_float(), u2 = get_random_float();
+        uint32_t k = triangleDistribution.empty() ? 0 : triangleDistribution.sample(u1, u2, pmf);
+        Vector3f v0, v1, v2;
+        worldTriangle(k, v0, v1, v2);
+        float x = std::sqrt(get_random_float()), y = get_random_float();
+        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+        pos.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+        pos.emit = pMaterial->getEmission();
+        pos.obj = this;
+        pos.pMaterial = pMaterial;
+        pdf = 1.0f / area;
+    }
+    float getArea()
+    {
+        return area;
+    }
+    bool hasEmit()
+    {
+        return pMaterial->hasEmission();
+    }
+
+public:
+    MeshTriangle* mesh;//shared, has to outlive its instances
+    Transform toWorld;
+    Transform toObject;
+    bool mirrored;//toWorld flips handedness
+    Bounds3 worldBounds;
+    float area;
+    AliasTable triangleDistribution;//world space triangle areas, built for emissive instances
+
+    Material *pMaterial;
+};
+
+#endif //RAYTRACING_INSTANCE_H
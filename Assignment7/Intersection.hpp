@@ -29,6 +29,7 @@ struct Intersection
         distance= std::numeric_limits<double>::max();
         obj =nullptr;
         pMaterial=nullptr;
+        triangleIndex = -1;
 
 #ifdef RECORD_RAY_HIT_PATH
         curBVHNode = nullptr;;
@@ -42,6 +43,7 @@ struct Intersection
     double distance;
     Object* obj;
     Material* pMaterial;
+    int triangleIndex;// which triangle of a mesh was hit, -1 for other objects
 
 #ifdef RECORD_RAY_HIT_PATH
     BVHBuildNode* curBVHNode;
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include "LightBVH.hpp"
+
+static const int LIGHT_BUCKET_COUNT = 12;
+
+static float safeSqrt(float x)
+{
+    return std::sqrt(std::max(0.0f, x));
+}
+
+static float axisOf(const Vector3f& v, int dim)
+{
+    return dim == 0 ? v.x : (dim == 1 ? v.y : v.z);
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) of two angles given by their sines and cosines
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+float LightBounds::importance(const Vector3f& p, const Vector3f& n) const
+{
+    return LightBoundsImportance(*this).importance(p, n);
+}
+
+LightBoundsImportance::LightBoundsImportance(const LightBounds& lightBounds)
+    : center(0.5f * (lightBounds.bounds.pMin + lightBounds.bounds.pMax)), axis(lightBounds.axis),
+      cosThetaO(lightBounds.cosThetaO), sinThetaO(safeSqrt(1.0f - lightBounds.cosThetaO * lightBounds.cosThetaO)),
+      power(lightBounds.power)
+{
+    Vector3f diagonal = lightBounds.bounds.Diagonal();
+    radius2 = 0.25f * dotProduct(diagonal, diagonal);
+}
+
+float LightBoundsImportance::importance(const Vector3f& p, const Vector3f& n) const
+{
+    // everything is measured from the bounding sphere of the emitters, which keeps the estimate
+    // conservative: the cone of directions the box covers is added to every angle
+    Vector3f toPoint = p - center;
+    float distance2 = dotProduct(toPoint, toPoint);
+    Vector3f wi = distance2 > 0.0f ? toPoint / std::sqrt(distance2) : axis;
+
+    float cosThetaW = dotProduct(axis, wi);
+    float sinThetaW = safeSqrt(1.0f - cosThetaW * cosThetaW);
+    float cosThetaB = distance2 < radius2 ? -1.0f : safeSqrt(1.0f - radius2 / distance2);
+    float sinThetaB = safeSqrt(1.0f - cosThetaB * cosThetaB);
+
+    // smallest angle between p and an emission direction of the node, emission stops at 90 degrees
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= 0.0f)
+        return 0.0f;
+
+    float result = power * cosThetaP / std::max(distance2, radius2);
+    if (dotProduct(n, n) > 0.0f)
+    {
+        float cosThetaI = std::fabs(dotProduct(wi, n));
+        float sinThetaI = safeSqrt(1.0f - cosThetaI * cosThetaI);
+        result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+    return std::max(result, 0.0f);
+}
+
+// rotate v by angle around the unit vector k (Rodrigues)
+static Vector3f rotate(const Vector3f& v, const Vector3f& k, float angle)
+{
+    float c = std::cos(angle), s = std::sin(angle);
+    return v * c + crossProduct(k, v) * s + k * (dotProduct(k, v) * (1.0f - c));
+}
+
+LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+    LightBounds result;
+    result.bounds = Union(a.bounds, b.bounds);
+    result.power = a.power + b.power;
+
+    // smallest cone holding both normal cones
+    float thetaA = std::acos(clamp(-1, 1, a.cosThetaO));
+    float thetaB = std::acos(clamp(-1, 1, b.cosThetaO));
+    float thetaD = std::acos(clamp(-1, 1, dotProduct(a.axis, b.axis)));
+    if (std::min(thetaD + thetaB, (float)M_PI) <= thetaA)
+    {
+        result.axis = a.axis;
+        result.cosThetaO = a.cosThetaO;
+        return result;
+    }
+    if (std::min(thetaD + thetaA, (float)M_PI) <= thetaB)
+    {
+        result.axis = b.axis;
+        result.cosThetaO = b.cosThetaO;
+        return result;
+    }
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    Vector3f rotationAxis = crossProduct(a.axis, b.axis);
+    float rotationLength2 = dotProduct(rotationAxis, rotationAxis);
+    if (thetaO >= M_PI || rotationLength2 == 0.0f)
+    {
+        result.axis = a.axis;
+        result.cosThetaO = -1.0f;
+        return result;
+    }
+    result.axis = normalize(rotate(a.axis, rotationAxis / std::sqrt(rotationLength2), thetaO - thetaA));
+    result.cosThetaO = std::cos(thetaO);
+    return result;
+}
+
+// solid angle measure of a normal cone widened by the 90 degree emission spread (pbrt-v4 M_Omega)
+static float orientationMeasure(float cosThetaO)
+{
+    float thetaO = std::acos(clamp(-1, 1, cosThetaO));
+    float thetaW = std::min(thetaO + (float)M_PI / 2, (float)M_PI);
+    float sinThetaO = std::sin(thetaO);
+    return 2 * M_PI * (1 - cosThetaO)
+        + M_PI / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO + cosThetaO);
+}
+
+void LightBVH::build(std::vector<LightPrimitive> primitives)
+{
+    lights = std::move(primitives);
+    nodes.clear();
+    firstLight.clear();
+    leafOfLight.assign(lights.size(), -1);
+    for (int i = (int)lights.size() - 1; i >= 0; --i)
+    {
+        firstLight[lights[i].object] = i;
+    }
+    if (lights.empty())
+        return;
+
+    std::vector<int> order(lights.size());
+    for (int i = 0; i < (int)lights.size(); ++i)
+    {
+        order[i] = i;
+    }
+    nodes.reserve(2 * lights.size() - 1);
+    nodeBounds.resize(2 * lights.size() - 1);
+    buildRecursive(order, 0, (int)order.size(), -1);
+    nodeBounds.clear();
+    nodeBounds.shrink_to_fit();
+}
+
+int LightBVH::buildRecursive(std::vector<int>& order, int begin, int end, int parent)
+{
+    int nodeIndex = (int)nodes.size();
+    nodes.emplace_back();
+    nodes[nodeIndex].parent = parent;
+    if (end - begin == 1)
+    {
+        nodes[nodeIndex].light = order[begin];
+        nodes[nodeIndex].lightBounds = LightBoundsImportance(lights[order[begin]].lightBounds);
+        nodeBounds[nodeIndex] = lights[order[begin]].lightBounds;
+        leafOfLight[order[begin]] = nodeIndex;
+        return nodeIndex;
+    }
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = begin; i < end; ++i)
+    {
+        bounds = Union(bounds, lights[order[i]].lightBounds.bounds);
+        centroidBounds = Union(centroidBounds, lights[order[i]].lightBounds.bounds.Centroid());
+    }
+    Vector3f extent = bounds.Diagonal();
+    float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+    // binned surface area orientation heuristic: power * box area * normal cone measure per side,
+    // splits across the long axis are preferred
+    float bestCost = std::numeric_limits<float>::max();
+    int bestDim = -1, bestBoundary = -1;
+    for (int dim = 0; dim < 3; ++dim)
+    {
+        float centroidMin = axisOf(centroidBounds.pMin, dim), centroidMax = axisOf(centroidBounds.pMax, dim);
+        if (centroidMax <= centroidMin)
+            continue;
+        auto bucketOf = [&](int light) {
+            float offset = (axisOf(lights[light].lightBounds.bounds.Centroid(), dim) - centroidMin) / (centroidMax - centroidMin);
+            return std::min((int)(LIGHT_BUCKET_COUNT * offset), LIGHT_BUCKET_COUNT - 1);
+        };
+        int bucketCount[LIGHT_BUCKET_COUNT] = {};
+        LightBounds bucketBounds[LIGHT_BUCKET_COUNT];
+        for (int i = begin; i < end; ++i)
+        {
+            int b = bucketOf(order[i]);
+            bucketBounds[b] = bucketCount[b]++ == 0 ? lights[order[i]].lightBounds : Union(bucketBounds[b], lights[order[i]].lightBounds);
+        }
+
+        auto cost = [](const LightBounds& side) {
+            return side.power * (float)side.bounds.SurfaceArea() * orientationMeasure(side.cosThetaO);
+        };
+        float regularization = maxExtent / axisOf(extent, dim);
+        for (int boundary = 1; boundary < LIGHT_BUCKET_COUNT; ++boundary)
+        {
+            LightBounds left, right;
+            int leftCount = 0, rightCount = 0;
+            for (int b = 0; b < LIGHT_BUCKET_COUNT; ++b)
+            {
+                if (bucketCount[b] == 0)
+                    continue;
+                if (b < boundary)
+                    left = leftCount++ == 0 ? bucketBounds[b] : Union(left, bucketBounds[b]);
+                else
+                    right = rightCount++ == 0 ? bucketBounds[b] : Union(right, bucketBounds[b]);
+            }
+            if (leftCount == 0 || rightCount == 0)
+                continue;
+            float splitCost = regularization * (cost(left) + cost(right));
+            if (splitCost < bestCost)
+            {
+                bestCost = splitCost;
+                bestDim = dim;
+                bestBoundary = boundary;
+            }
+        }
+    }
+
+    int middle = (begin + end) / 2;
+    if (bestDim >= 0)
+    {
+        float centroidMin = axisOf(centroidBounds.pMin, bestDim), centroidMax = axisOf(centroidBounds.pMax, bestDim);
+        auto split = std::partition(order.begin() + begin, order.begin() + end, [&](int light) {
+            float offset = (axisOf(lights[light].lightBounds.bounds.Centroid(), bestDim) - centroidMin) / (centroidMax - centroidMin);
+            return std::min((int)(LIGHT_BUCKET_COUNT * offset), LIGHT_BUCKET_COUNT - 1) < bestBoundary;
+        });
+        middle = (int)(split - order.begin());
+    }
+
+    int firstChild = buildRecursive(order, begin, middle, nodeIndex);
+    int secondChild = buildRecursive(order, middle, end, nodeIndex);
+    nodes[nodeIndex].secondChild = secondChild;
+    nodeBounds[nodeIndex] = Union(nodeBounds[firstChild], nodeBounds[secondChild]);
+    nodes[nodeIndex].lightBounds = LightBoundsImportance(nodeBounds[nodeIndex]);
+    return nodeIndex;
+}
+
+bool LightBVH::sample(const Intersection& ref, Intersection& pos, float& pdf) const
+{
+    pdf = 0.0f;
+    if (nodes.empty())
+        return false;
+
+    // descend by the children's importance, reusing the random number for every decision
+    float u = get_random_float();
+    float pmf = 1.0f;
+    int nodeIndex = 0;
+    while (nodes[nodeIndex].light < 0)
+    {
+        int children[2] = { nodeIndex + 1, nodes[nodeIndex].secondChild };
+        float importance0 = nodes[children[0]].lightBounds.importance(ref.coords, ref.normal);
+        float importance1 = nodes[children[1]].lightBounds.importance(ref.coords, ref.normal);
+        if (importance0 == 0.0f && importance1 == 0.0f)
+            return false;
+        float p0 = importance0 / (importance0 + importance1);
+        if (u < p0)
+        {
+            nodeIndex = children[0];
+            pmf *= p0;
+            u = std::min(u / p0, 0.99999994f);
+        }
+        else
+        {
+            nodeIndex = children[1];
+            pmf *= 1.0f - p0;
+            u = std::min((u - p0) / (1.0f - p0), 0.99999994f);
+        }
+    }
+    if (nodeIndex == 0 && nodes[0].lightBounds.importance(ref.coords, ref.normal) == 0.0f)
+        return false;
+
+    const LightPrimitive& light = lights[nodes[nodeIndex].light];
+    if (light.triangle < 0)
+    {
+        light.object->Sample(pos, pdf);
+    }
+    else
+    {
+        float x = std::sqrt(get_random_float()), y = get_random_float();
+        pos.coords = light.v0 * (1.0f - x) + light.v1 * (x * (1.0f - y)) + light.v2 * (x * y);
+        pos.normal = normalize(crossProduct(light.v1 - light.v0, light.v2 - light.v0));
+        pos.emit = light.emit;
+        pos.obj = light.object;
+        pdf = 1.0f / light.area;
+    }
+    pdf *= pmf;
+    return true;
+}
+
+float LightBVH::pmf(const Intersection& ref, int light) const
+{
+    // the probability sample() reaches this leaf: the product of the choices on the way up
+    int nodeIndex = leafOfLight[light];
+    if (nodeIndex == 0)
+        return nodes[0].lightBounds.importance(ref.coords, ref.normal) > 0.0f ? 1.0f : 0.0f;
+
+    float pmf = 1.0f;
+    while (nodes[nodeIndex].parent >= 0)
+    {
+        int parent = nodes[nodeIndex].parent;
+        int sibling = nodeIndex == parent + 1 ? nodes[parent].secondChild : parent + 1;
+        float importance = nodes[nodeIndex].lightBounds.importance(ref.coords, ref.normal);
+        if (importance == 0.0f)
+            return 0.0f;
+        pmf *= importance / (importance + nodes[sibling].lightBounds.importance(ref.coords, ref.normal));
+        nodeIndex = parent;
+    }
+    return pmf;
+}
+
+float LightBVH::pdf(const Intersection& ref, const Intersection& lightPoint) const
+{
+    if (!lightPoint.happened || lightPoint.obj == nullptr)
+        return 0.0f;
+    auto found = firstLight.find(lightPoint.obj);
+    if (found == firstLight.end())
+        return 0.0f;
+    int light = found->second;
+    if (lights[light].triangle >= 0)//the triangles of a mesh follow each other in mesh order
+    {
+        if (lightPoint.triangleIndex < 0)
+            return 0.0f;
+        light += lightPoint.triangleIndex;
+    }
+    if (lights[light].area <= 0.0f)
+        return 0.0f;
+    return pmf(ref, light) / lights[light].area;
+}
@@ -0,0 +1,90 @@
+//
+// Light hierarchy over the scene's emitters, after the light BVH of pbrt-v4.
+// Every node bounds its emitters' positions, total power and emission directions, so a shading point
+// can estimate how much each subtree could contribute and descend towards the important lights.
+//
+
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+
+#include <unordered_map>
+#include <vector>
+#include "Object.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Vector.hpp"
+
+// Bounds of a set of one-sided emitters: where they are, how much they emit in total, and a cone
+// around axis (half angle acos(cosThetaO)) that holds their normals. They emit into the hemisphere
+// around each normal
+struct LightBounds
+{
+    Bounds3 bounds;
+    Vector3f axis;
+    float cosThetaO = 1.0f;
+    float power = 0.0f;
+
+    // estimated contribution to point p with surface normal n, never 0 where a light could reach p
+    float importance(const Vector3f& p, const Vector3f& n) const;
+};
+
+// what LightBounds::importance needs, precomputed once per node for the sampling loop
+struct LightBoundsImportance
+{
+    Vector3f center;// of the bounding sphere
+    float radius2;
+    Vector3f axis;
+    float cosThetaO, sinThetaO;
+    float power;
+
+    LightBoundsImportance() {}
+    explicit LightBoundsImportance(const LightBounds& lightBounds);
+    float importance(const Vector3f& p, const Vector3f& n) const;
+};
+
+LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+// an emitter: one triangle of an emissive mesh, or a whole emissive object when triangle < 0
+struct LightPrimitive
+{
+    Object* object;
+    int triangle;
+    Vector3f v0, v1, v2;// triangle only
+    Vector3f emit;
+    float area;
+    LightBounds lightBounds;
+};
+
+class LightBVH
+{
+public:
+    void build(std::vector<LightPrimitive> lights);
+    bool empty() const { return nodes.empty(); }
+    int lightCount() const { return (int)lights.size(); }
+
+    // picks an emitter by its importance for the shading point and samples a point on it,
+    // pdf is the area density of that point; false when no light can reach the point
+    bool sample(const Intersection& ref, Intersection& pos, float& pdf) const;
+    // area density sample() gives lightPoint, a point found by a ray from ref
+    float pdf(const Intersection& ref, const Intersection& lightPoint) const;
+
+private:
+    struct Node
+    {
+        LightBoundsImportance lightBounds;
+        int parent = -1;
+        int secondChild = -1;// interior: the first child directly follows its parent
+        int light = -1;// leaf: index into lights
+    };
+
+    int buildRecursive(std::vector<int>& order, int begin, int end, int parent);
+    float pmf(const Intersection& ref, int light) const;
+
+    std::vector<LightPrimitive> lights;
+    std::vector<Node> nodes;
+    std::vector<LightBounds> nodeBounds;//only while building
+    std::vector<int> leafOfLight;
+    std::unordered_map<const Object*, int> firstLight;//emitter object -> its first entry in lights
+};
+
+#endif //RAYTRACING_LIGHTBVH_H
@@ -0,0 +1,113 @@
+#include "MeshCache.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename)
+{
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+    file = handle;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize) || fileSize.QuadPart == 0)
+        return;
+    mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+        return;
+    data_ = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    size_ = data_ ? (size_t)fileSize.QuadPart : 0;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    // an empty file can not be mapped, it is treated as missing
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            data_ = (const char*)p;
+            size_ = (size_t)st.st_size;
+        }
+    }
+    close(fd);//the mapping keeps the file open
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (data_)
+        UnmapViewOfFile(data_);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+#else
+    if (data_)
+        munmap((void*)data_, size_);
+#endif
+}
+
+uint64_t hashBytes(const char* data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool hashFile(const std::string& filename, uint64_t& hash)
+{
+    MappedFile file(filename);
+    if (!file.valid())
+        return false;
+    hash = hashBytes(file.data(), file.size());
+    return true;
+}
+
+CacheWriter::CacheWriter(const std::string& filename)
+    : filename(filename), temporary(filename + ".tmp")
+{
+    fp = fopen(temporary.c_str(), "wb");
+}
+
+CacheWriter::~CacheWriter()
+{
+    if (fp)//finish() was never reached
+    {
+        fclose(fp);
+        remove(temporary.c_str());
+    }
+}
+
+bool CacheWriter::finish()
+{
+    if (!fp)
+        return false;
+    bool written = fclose(fp) == 0 && !failed;
+    fp = nullptr;
+    if (written)
+    {
+        // rename does not replace an existing file everywhere
+        remove(filename.c_str());
+        written = rename(temporary.c_str(), filename.c_str()) == 0;
+    }
+    if (!written)
+        remove(temporary.c_str());
+    return written;
+}
@@ -0,0 +1,139 @@
+//
+// Binary cache of a loaded mesh and its BVH, so a scene rendered again skips OBJ parsing and the BVH build.
+// A cache file sits next to its OBJ and is only used when the OBJ hash and the build parameters still match.
+//
+
+#ifndef RAYTRACING_MESHCACHE_H
+#define RAYTRACING_MESHCACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// bump whenever anything written to a cache file changes layout
+static const uint32_t MESH_CACHE_VERSION = 1;
+
+struct MeshCacheHeader
+{
+    char magic[8];            // "PA7MESH"
+    uint32_t version;
+    uint32_t simdWidth;       // wide nodes and triangle blocks are SIMD_WIDTH lanes wide
+    uint64_t sourceHash;      // of the OBJ file bytes
+    int32_t splitMethod;
+    int32_t maxPrimsInNode;
+    uint32_t numVertices;
+    uint32_t numTriangles;
+    uint64_t fileSize;        // catches files cut short by a crash while writing
+};
+
+// Read-only view of a whole file, memory mapped so nothing is read before it is touched
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool valid() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+// 64 bit FNV-1a
+uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+// false when the file can not be read
+bool hashFile(const std::string& filename, uint64_t& hash);
+
+// Walks a mapped cache file front to back. Every array is copied out in one block, a read past the end fails
+// and leaves the reader failed, so callers only check ok() once at the end
+class CacheReader
+{
+public:
+    CacheReader(const char* data, size_t size) : cursor(data), end(data + size) {}
+
+    template <typename T>
+    bool read(T& value) { return read(&value, 1); }
+
+    template <typename T>
+    bool read(T* values, size_t count)
+    {
+        size_t bytes = count * sizeof(T);
+        if (failed || count > (size_t)(end - cursor) / sizeof(T))
+        {
+            failed = true;
+            return false;
+        }
+        memcpy((void*)values, cursor, bytes);
+        cursor += bytes;
+        return true;
+    }
+
+    // an array stored as its element count followed by the elements
+    template <typename Container>
+    bool readArray(Container& values)
+    {
+        uint64_t count = 0;
+        if (!read(count) || count > (size_t)(end - cursor) / sizeof(values[0]))
+        {
+            failed = true;
+            return false;
+        }
+        values.resize((size_t)count);
+        return read(values.data(), values.size());
+    }
+
+    bool ok() const { return !failed; }
+    bool atEnd() const { return cursor == end; }
+
+private:
+    const char* cursor;
+    const char* end;
+    bool failed = false;
+};
+
+// Writes a cache file under a temporary name and moves it into place on finish(),
+// so a reader never sees a half written file
+class CacheWriter
+{
+public:
+    explicit CacheWriter(const std::string& filename);
+    ~CacheWriter();
+
+    template <typename T>
+    void write(const T& value) { write(&value, 1); }
+
+    template <typename T>
+    void write(const T* values, size_t count)
+    {
+        if (fp && count > 0 && fwrite(values, sizeof(T), count, fp) != count)
+            failed = true;
+    }
+
+    template <typename Container>
+    void writeArray(const Container& values)
+    {
+        write((uint64_t)values.size());
+        write(values.data(), values.size());
+    }
+
+    long position() const { return fp ? ftell(fp) : 0; }
+    void rewind() { if (fp) fseek(fp, 0, SEEK_SET); }
+    bool finish();
+
+private:
+    std::string filename, temporary;
+    FILE* fp = nullptr;
+    bool failed = false;
+};
+
+#endif //RAYTRACING_MESHCACHE_H
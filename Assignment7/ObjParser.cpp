@@ -0,0 +1,284 @@
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include "ObjParser.hpp"
+#include "MeshCache.hpp"
+#include "Parallel.hpp"
+
+// a face corner resolved to 0-based indices, texcoord is -1 when the face gives none
+struct ObjCorner
+{
+    int position;
+    int texcoord;
+};
+
+// A piece of the file cut at line starts. Chunks are parsed independently, once the number of positions
+// and texture coordinates in front of each is known, so relative indices resolve as in one serial pass
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+    int positionBase = 0, texcoordBase = 0;// defined by the chunks before this one
+    int positionCount = 0, texcoordCount = 0;// defined in this one
+    std::vector<ObjCorner> corners;// three per triangle
+    int skippedFaces = 0;
+};
+
+// a chunk is not worth a thread below this size
+static const size_t OBJ_MIN_CHUNK_SIZE = 1 << 20;
+
+enum class ObjLineKind { Other, Position, Texcoord, Face };
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && isSpace(*p))
+        ++p;
+    return p;
+}
+
+static bool parseFloat(const char*& p, const char* end, float& value)
+{
+    p = skipSpaces(p, end);
+    if (p < end && *p == '+')//from_chars does not take a leading plus
+        ++p;
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec == std::errc::result_out_of_range)
+    {
+        // tiny or huge values, strtof rounds them to 0 or inf instead of failing
+        char number[64] = {};
+        memcpy(number, p, std::min<size_t>(result.ptr - p, sizeof(number) - 1));
+        value = strtof(number, nullptr);
+    }
+    else if (result.ec != std::errc())
+    {
+        return false;
+    }
+    p = result.ptr;
+    return true;
+}
+
+// OBJ indices start at 1, negative ones count back from the last element read so far
+static bool parseIndex(const char*& p, const char* end, int count, int& index)
+{
+    int raw = 0;
+    std::from_chars_result result = std::from_chars(p, end, raw);
+    if (result.ec != std::errc() || raw == 0)
+        return false;
+    p = result.ptr;
+    index = raw > 0 ? raw - 1 : count + raw;
+    return true;
+}
+
+// p is the first non-blank character of the line, the data starts kindLength characters later
+static ObjLineKind lineKind(const char* p, const char* lineEnd, int& kindLength)
+{
+    kindLength = 2;
+    if (lineEnd - p >= 2 && p[0] == 'v' && isSpace(p[1]))
+        return ObjLineKind::Position;
+    if (lineEnd - p >= 2 && p[0] == 'f' && isSpace(p[1]))
+        return ObjLineKind::Face;
+    kindLength = 3;
+    if (lineEnd - p >= 3 && p[0] == 'v' && p[1] == 't' && isSpace(p[2]))
+        return ObjLineKind::Texcoord;
+    return ObjLineKind::Other;
+}
+
+// calls f(kind, data, lineEnd) for every line of [p, end)
+template <typename F>
+static void forEachLine(const char* p, const char* end, F f)
+{
+    while (p < end)
+    {
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        const char* lineEnd = newline ? newline : end;
+        p = skipSpaces(p, lineEnd);
+        int kindLength = 0;
+        ObjLineKind kind = lineKind(p, lineEnd, kindLength);
+        if (kind != ObjLineKind::Other)
+            f(kind, p + kindLength - 1, lineEnd);
+        p = newline ? newline + 1 : end;
+    }
+}
+
+// "f v v v ...", each corner as v, v/vt, v//vn or v/vt/vn.
+// positionCount and texcoordCount are the elements defined above this line in the whole file
+static void parseFace(const char* p, const char* end, int positionCount, int texcoordCount, ObjChunk& chunk)
+{
+    std::vector<ObjCorner>& corners = chunk.corners;
+    size_t firstCorner = corners.size();
+    ObjCorner first = {}, previous = {};
+    int cornerCount = 0;
+    while (true)
+    {
+        p = skipSpaces(p, end);
+        if (p >= end || *p == '#')
+            break;
+        ObjCorner corner = { -1, -1 };
+        bool valid = parseIndex(p, end, positionCount, corner.position);
+        if (valid && p < end && *p == '/')
+        {
+            ++p;
+            if (p < end && *p != '/')
+                valid = parseIndex(p, end, texcoordCount, corner.texcoord);
+            while (p < end && !isSpace(*p))//the normal index is not needed
+                ++p;
+        }
+        valid = valid && (p >= end || isSpace(*p))
+            && corner.position >= 0 && corner.position < positionCount
+            && corner.texcoord >= -1 && corner.texcoord < texcoordCount;
+        if (!valid)
+        {
+            corners.resize(firstCorner);
+            chunk.skippedFaces++;
+            return;
+        }
+
+        if (cornerCount == 0)
+            first = corner;
+        else if (cornerCount >= 2)
+        {
+            corners.push_back(first);
+            corners.push_back(previous);
+            corners.push_back(corner);
+        }
+        previous = corner;
+        cornerCount++;
+    }
+    if (cornerCount > 0 && cornerCount < 3)
+        chunk.skippedFaces++;
+}
+
+static void countLines(ObjChunk& chunk)
+{
+    forEachLine(chunk.begin, chunk.end, [&](ObjLineKind kind, const char*, const char*) {
+        chunk.positionCount += kind == ObjLineKind::Position;
+        chunk.texcoordCount += kind == ObjLineKind::Texcoord;
+    });
+}
+
+// writes the chunk's positions and texture coordinates at its bases, faces go to chunk.corners
+static void parseLines(ObjChunk& chunk, std::vector<Vector3f>& positions, std::vector<Vector2f>& texcoords)
+{
+    int positionCount = chunk.positionBase, texcoordCount = chunk.texcoordBase;
+    forEachLine(chunk.begin, chunk.end, [&](ObjLineKind kind, const char* p, const char* lineEnd) {
+        if (kind == ObjLineKind::Position)
+        {
+            // a line that does not parse keeps its slot so the vertices after it keep their numbers
+            Vector3f& position = positions[positionCount++];
+            if (!(parseFloat(p, lineEnd, position.x) && parseFloat(p, lineEnd, position.y) && parseFloat(p, lineEnd, position.z)))
+                position = Vector3f();
+        }
+        else if (kind == ObjLineKind::Texcoord)
+        {
+            Vector2f& texcoord = texcoords[texcoordCount++];
+            if (parseFloat(p, lineEnd, texcoord.x))
+                parseFloat(p, lineEnd, texcoord.y);//v is optional
+        }
+        else
+        {
+            parseFace(p, lineEnd, positionCount, texcoordCount, chunk);
+        }
+    });
+}
+
+// Turns the corners into vertices, a position used with several texture coordinates gets one vertex per pair.
+// The chunks are walked in file order, so vertices are numbered by first use whatever the chunking was
+static void buildIndexedMesh(const std::vector<ObjChunk>& chunks, const std::vector<Vector3f>& positions,
+                             const std::vector<Vector2f>& texcoords, ObjMesh& mesh)
+{
+    const uint32_t unused = 0xffffffffu;
+    std::vector<uint32_t> vertexOfPosition(positions.size(), unused);//first vertex made from the position
+    std::vector<int> texcoordOfVertex;
+    std::unordered_map<uint64_t, uint32_t> otherVertices;
+
+    size_t cornerCount = 0;
+    mesh.skippedFaces = 0;
+    for (const ObjChunk& chunk : chunks)
+    {
+        cornerCount += chunk.corners.size();
+        mesh.skippedFaces += chunk.skippedFaces;
+    }
+    mesh.vertices.clear();
+    mesh.stCoordinates.clear();
+    mesh.vertexIndex.resize(cornerCount);
+    auto addVertex = [&](const ObjCorner& corner) {
+        mesh.vertices.push_back(positions[corner.position]);
+        mesh.stCoordinates.push_back(corner.texcoord >= 0 ? texcoords[corner.texcoord] : Vector2f());
+        texcoordOfVertex.push_back(corner.texcoord);
+        return (uint32_t)mesh.vertices.size() - 1;
+    };
+    uint32_t* vertexIndex = mesh.vertexIndex.data();
+    for (const ObjChunk& chunk : chunks)
+    {
+        for (const ObjCorner& corner : chunk.corners)
+        {
+            uint32_t& first = vertexOfPosition[corner.position];
+            if (first == unused)
+                first = addVertex(corner);
+            if (texcoordOfVertex[first] == corner.texcoord)
+            {
+                *vertexIndex++ = first;
+                continue;
+            }
+            uint64_t key = (uint64_t)corner.position << 32 | (uint32_t)(corner.texcoord + 1);
+            auto found = otherVertices.find(key);
+            if (found == otherVertices.end())
+                found = otherVertices.emplace(key, addVertex(corner)).first;
+            *vertexIndex++ = found->second;
+        }
+    }
+}
+
+void parseObj(const char* data, size_t size, ObjMesh& mesh, int threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = hardwareThreads();
+    int chunkCount = (int)std::max<size_t>(1, std::min<size_t>(threadCount, size / OBJ_MIN_CHUNK_SIZE));
+
+    // cut at even offsets moved forward to the next line start
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char* end = data + size;
+    const char* begin = data;
+    for (int c = 0; c < chunkCount; ++c)
+    {
+        const char* cut = c + 1 < chunkCount ? data + size / chunkCount * (c + 1) : end;
+        if (cut < begin)
+            cut = begin;
+        const char* newline = cut < end ? (const char*)memchr(cut, '\n', end - cut) : nullptr;
+        cut = c + 1 < chunkCount && newline ? newline + 1 : end;
+        chunks[c].begin = begin;
+        chunks[c].end = cut;
+        begin = cut;
+    }
+
+    // count first so every chunk knows where its elements go, then parse straight into the shared arrays
+    parallelFor(chunkCount, threadCount, [&](int c) { countLines(chunks[c]); });
+    int positionCount = 0, texcoordCount = 0;
+    for (ObjChunk& chunk : chunks)
+    {
+        chunk.positionBase = positionCount;
+        chunk.texcoordBase = texcoordCount;
+        positionCount += chunk.positionCount;
+        texcoordCount += chunk.texcoordCount;
+    }
+    std::vector<Vector3f> positions(positionCount);
+    std::vector<Vector2f> texcoords(texcoordCount);
+    parallelFor(chunkCount, threadCount, [&](int c) { parseLines(chunks[c], positions, texcoords); });
+
+    buildIndexedMesh(chunks, positions, texcoords, mesh);
+}
+
+bool loadObj(const std::string& filename, ObjMesh& mesh, int threadCount)
+{
+    MappedFile file(filename);
+    if (!file.valid())
+        return false;
+    parseObj(file.data(), file.size(), mesh, threadCount);
+    return true;
+}
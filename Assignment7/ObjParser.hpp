@@ -0,0 +1,28 @@
+//
+// OBJ reader for what MeshTriangle keeps: positions, texture coordinates and triangles.
+// Parses a memory mapped file in place, no per-line strings, and writes straight into indexed buffers.
+//
+
+#ifndef RAYTRACING_OBJPARSER_H
+#define RAYTRACING_OBJPARSER_H
+
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// Every distinct position / texture coordinate pair the faces use becomes one vertex.
+// Polygons are split into fans around their first corner, normals, groups and materials are ignored
+struct ObjMesh
+{
+    std::vector<Vector3f> vertices;
+    std::vector<Vector2f> stCoordinates;// one per vertex, 0 where the face gives none
+    std::vector<uint32_t> vertexIndex;// three per triangle
+    int skippedFaces = 0;// faces referencing vertices the file does not have
+};
+
+// Large files are cut into chunks at line starts and parsed on up to threadCount threads, all hardware
+// threads when it is 0. The mesh comes out the same for any thread count. false when the file can not be read
+bool loadObj(const std::string& filename, ObjMesh& mesh, int threadCount = 0);
+void parseObj(const char* data, size_t size, ObjMesh& mesh, int threadCount = 0);
+
+#endif //RAYTRACING_OBJPARSER_H
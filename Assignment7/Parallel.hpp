@@ -0,0 +1,49 @@
+//
+// Minimal fork-join helper for the loaders and builders; the renderer keeps its own tile workers.
+//
+
+#ifndef RAYTRACING_PARALLEL_H
+#define RAYTRACING_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+inline int hardwareThreads()
+{
+    return (int)std::max(1u, std::thread::hardware_concurrency());
+}
+
+// runs task(i) for i in [0, count) on up to threadCount threads, the caller being one of them
+template <typename F>
+void parallelFor(int count, int threadCount, F task)
+{
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i = next++; i < count; i = next++)
+            task(i);
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < std::min(threadCount, count); ++t)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// task(begin, end) over [0, count) cut into ranges of chunkSize, for loops whose items are too cheap to hand out one by one
+template <typename F>
+void parallelForChunks(int count, int chunkSize, int threadCount, F task)
+{
+    int chunkCount = (count + chunkSize - 1) / chunkSize;
+    parallelFor(chunkCount, threadCount, [&](int chunk) {
+        task(chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+    });
+}
+
+#endif //RAYTRACING_PARALLEL_H
@@ -3,7 +3,12 @@
 //
 
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include "Scene.hpp"
+
 #include "Renderer.hpp"
 
 
@@ -11,57 +16,229 @@ inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+inline float luminance(const Vector3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// standard error of the pixel's mean luminance relative to that mean
+static float relativeError(const PixelSample& pixel)
+{
+    if (pixel.count < 2)
+        return std::numeric_limits<float>::infinity();
+    double mean = luminance(pixel.sum) / pixel.count;
+    double variance = std::max(0.0, (pixel.luminanceSquareSum - mean * mean * pixel.count) / (pixel.count - 1));
+    return (float)(std::sqrt(variance / pixel.count) / std::max(mean, 1e-3));
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 //ԤԶ㣬ûViewportͶӰ㣬ֱӽndcռӲ3DϵǷ̳ҵ
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    std::vector<PixelSample> film(scene.width * scene.height);
+
+    // change the spp value to change sample ammount
+    std::cout << "SPP: " << spp << "\n";
+
+    if (!progressive && !adaptive)
+    {
+        RenderPass(scene, film, spp, 0);
+        UpdateProgress(1.f);
+        WriteImage(scene, film, "binary.ppm");
+        return;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto lastPreview = start;
+    auto secondsSince = [](Clock::time_point t) { return std::chrono::duration<double>(Clock::now() - t).count(); };
+
+    int passes = 0;
+    int activePixels = (int)film.size();
+    while (passes < spp && activePixels > 0)
+    {
+        RenderPass(scene, film, 1, passes);
+        ++passes;
+        if (adaptive && passes >= minSpp)
+        {
+            activePixels = UpdateActivePixels(scene, film);
+        }
+        if (timeBudget > 0.0 && secondsSince(start) >= timeBudget)
+            break;
+        if (passes < spp && secondsSince(lastPreview) >= previewInterval)
+        {
+            WriteImage(scene, film, "binary.ppm");
+            lastPreview = Clock::now();
+        }
+    }
+    UpdateProgress(1.f);
+
+    long long totalSamples = 0;
+    for (const PixelSample& pixel : film)
+    {
+        totalSamples += pixel.count;
+    }
+    std::cout << "\n" << (adaptive ? "Adaptive" : "Progressive") << ": " << passes << " passes in " << secondsSince(start) << " s"
+              << (timeBudget > 0.0 && passes < spp && activePixels > 0 ? ", time budget reached" : "") << "\n";
+    std::cout << "Samples: " << totalSamples << ", " << totalSamples / (double)film.size() << " spp on average, "
+              << 100.0 * totalSamples / ((double)film.size() * passes) << "% of uniform sampling\n";
+    WriteImage(scene, film, "binary.ppm");
+    if (adaptive)
+    {
+        WriteErrorMap(scene, film, "error.ppm");
+    }
+}
+
+int Renderer::UpdateActivePixels(const Scene& scene, std::vector<PixelSample>& film) const
+{
+    // one pixel's variance estimate from a few samples misses rare bright paths, so the error is
+    // pooled over blocks and a block stops as a whole
+    int activePixels = 0;
+    for (int by = 0; by < scene.height; by += adaptiveBlockSize)
+    {
+        for (int bx = 0; bx < scene.width; bx += adaptiveBlockSize)
+        {
+            int x1 = std::min(bx + adaptiveBlockSize, scene.width), y1 = std::min(by + adaptiveBlockSize, scene.height);
+            double errorSum = 0.0;
+            bool active = false;
+            for (int j = by; j < y1; ++j)
+            {
+                for (int i = bx; i < x1; ++i)
+                {
+                    const PixelSample& pixel = film[j * scene.width + i];
+                    float error = relativeError(pixel);
+                    errorSum += error * error;
+                    active = active || pixel.active;
+                }
+            }
+            active = active && std::sqrt(errorSum / ((x1 - bx) * (y1 - by))) > errorThreshold;
+            for (int j = by; j < y1; ++j)
+            {
+                for (int i = bx; i < x1; ++i)
+                {
+                    film[j * scene.width + i].active = active;
+                }
+            }
+            activePixels += active ? (x1 - bx) * (y1 - by) : 0;
+        }
+    }
+    return activePixels;
+}
 
+void Renderer::RenderPass(const Scene& scene, std::vector<PixelSample>& film, int samples, int pass)
+{
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
-    int m = 0;
 
-    // change the spp value to change sample ammount
-    int spp = 16;
-    std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float u = 2 * ((float)i + 0.5) / scene.width;
-            float v = 2 * ((float)j + 0.5) / scene.height;
-
-            //ĻռƫƵNDCһԭ
-            u = u - 1.0f;
-            v = 1.0f - v;//ĻռyϽΪʼ㣬NDC½Ϊʼ
-
-            //ͨĻNDCռıԭĻ¶ӦNDCռ䷽
-            float x = u * scale * imageAspectRatio;
-            float y = v * scale;
-
-            //ΪndcռviewڵģͿռغϣԲҪת,ϵռཻ
-            Vector3f dir_world = normalize(Vector3f(-x, y, 1)); //jingz CTMΪʲôҪһЩ// Don't forget to normalize this direction!
-            for (int k = 0; k < spp; k++)
+    // split the image into tiles, every worker pulls the next unrendered tile from a shared counter
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+    int tileCount = tilesX * tilesY;
+    std::atomic<int> nextTile(0);
+    std::atomic<int> finishedTiles(0);
+    std::mutex progressMutex;
+    // the bar is only redrawn when its percentage moves, the previous pass already drew the one it starts at
+    std::atomic<int> printedPercent(pass > 0 ? int((float)pass / spp * 100.0) : -1);
+
+    int workerCount = threadCount > 0 ? threadCount : (int)std::max(1u, std::thread::hardware_concurrency());
+#ifdef RECORD_RAY_HIT_PATH
+    workerCount = 1;//the recorded hit path is written into the shared BVH nodes
+#endif
+    if (pass == 0)
+    {
+        std::cout << "Threads: " << workerCount << "\n";
+    }
+
+    auto renderTiles = [&]()
+    {
+        for (int tile = nextTile++; tile < tileCount; tile = nextTile++)
+        {
+            int x0 = (tile % tilesX) * tileSize, x1 = std::min(x0 + tileSize, scene.width);
+            int y0 = (tile / tilesX) * tileSize, y1 = std::min(y0 + tileSize, scene.height);
+
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    PixelSample& film_pixel = film[j * scene.width + i];
+                    if (!film_pixel.active)
+                        continue;
+
+                    // generate primary ray direction
+                    float u = 2 * ((float)i + 0.5) / scene.width;
+                    float v = 2 * ((float)j + 0.5) / scene.height;
+
+                    //ĻռƫƵNDCһԭ
+                    u = u - 1.0f;
+                    v = 1.0f - v;//ĻռyϽΪʼ㣬NDC½Ϊʼ
+
+                    //ͨĻNDCռıԭĻ¶ӦNDCռ䷽
+                    float x = u * scale * imageAspectRatio;
+                    float y = v * scale;
+
+                    //ΪndcռviewڵģͿռغϣԲҪת,ϵռཻ
+                    Vector3f dir_world = normalize(Vector3f(-x, y, 1)); //jingz CTMΪʲôҪһЩ// Don't forget to normalize this direction!
+                    // every pass gets its own stream per pixel
+                    seed_random(seed, ((uint64_t)pass * scene.height + j) * scene.width + i);
+                    for (int k = 0; k < samples; k++)
+                    {
+                        Vector3f radiance = scene.castRay(Ray(eye_pos, dir_world), 0);
+                        film_pixel.sum += radiance;
+                        film_pixel.luminanceSquareSum += luminance(radiance) * luminance(radiance);
+                    }
+                    film_pixel.count += samples;
+                }
+            }
+
+            int finished = ++finishedTiles;
+            float progress = (pass + samples * finished / (float)tileCount) / spp;
+            int percent = int(progress * 100.0);
+            if (percent > printedPercent.load(std::memory_order_relaxed))
             {
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir_world), 0) / spp;
+                std::lock_guard<std::mutex> lock(progressMutex);
+                if (percent > printedPercent.load(std::memory_order_relaxed))
+                {
+                    printedPercent.store(percent, std::memory_order_relaxed);
+                    UpdateProgress(progress);
+                }
             }
-            m++;
         }
-        UpdateProgress(j / (float)scene.height);
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < workerCount; ++t)
+    {
+        workers.emplace_back(renderTiles);
     }
-    UpdateProgress(1.f);
+    renderTiles();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
 
+void Renderer::WriteImage(const Scene& scene, const std::vector<PixelSample>& film, const char* filename) const
+{
     // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
+    FILE* fp = fopen(filename, "wb");
     (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
     for (auto i = 0; i < scene.height * scene.width; ++i) {
         static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        Vector3f pixel = film[i].count > 0 ? film[i].sum / film[i].count : Vector3f();
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, pixel.z), 0.6f));
         fwrite(color, 1, 3, fp);
     }
     fclose(fp);    
 }
+
+void Renderer::WriteErrorMap(const Scene& scene, const std::vector<PixelSample>& film, const char* filename) const
+{
+    FILE* fp = fopen(filename, "wb");
+    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
+    for (auto i = 0; i < scene.height * scene.width; ++i) {
+        unsigned char grey = (unsigned char)(255 * clamp(0, 1, 0.5f * relativeError(film[i]) / errorThreshold));
+        unsigned char color[3] = { grey, grey, grey };
+        fwrite(color, 1, 3, fp);
+    }
+    fclose(fp);
+}
@@ -12,10 +12,44 @@ struct hit_payload
     Object* hit_obj;
 };
 
+// what one pixel has accumulated so far
+struct PixelSample
+{
+    Vector3f sum;// radiance sum, divided by count when an image is written
+    double luminanceSquareSum = 0.0;// with sum gives the variance adaptive sampling needs
+    int count = 0;
+    bool active = true;// adaptive sampling stops adding samples once this pixel is converged
+};
+
 class Renderer
 {
 public:
+    // setting up options
+    int spp = 16;// progressive mode: the target spp, adaptive mode: the most any pixel gets
+    int threadCount = 0;// 0 means one worker per hardware thread
+    int tileSize = 16;
+    unsigned int seed = 0;// same seed renders the same image, whatever the thread count
+
+    // progressive mode renders 1 spp per pass into a float buffer and writes a preview every previewInterval seconds
+    bool progressive = false;
+    double timeBudget = 0.0;// seconds, progressive rendering stops after the pass that crosses it, 0 means no limit
+    double previewInterval = 10.0;
+
+    // adaptive mode is progressive, but after minSpp a pixel only gets more passes while the
+    // relative standard error of its mean luminance is above errorThreshold
+    bool adaptive = false;
+    int minSpp = 8;
+    float errorThreshold = 0.1f;
+    int adaptiveBlockSize = 8;
+
     void Render(const Scene& scene);
 
 private:
+    // adds samples more spp to every active pixel of film, pass numbers the random streams
+    void RenderPass(const Scene& scene, std::vector<PixelSample>& film, int samples, int pass);
+    // clears active on the blocks of pixels that are converged, returns how many pixels stay active
+    int UpdateActivePixels(const Scene& scene, std::vector<PixelSample>& film) const;
+    void WriteImage(const Scene& scene, const std::vector<PixelSample>& film, const char* filename) const;
+    // relative error of every pixel, errorThreshold maps to mid grey
+    void WriteErrorMap(const Scene& scene, const std::vector<PixelSample>& film, const char* filename) const;
 };
@@ -0,0 +1,139 @@
+//
+// Float vector as wide as the compiler targets: 8 lanes with AVX, 4 lanes with SSE,
+// otherwise 4 plain floats so the wide BVH code still builds everywhere.
+//
+
+#ifndef RAYTRACING_SIMD_H
+#define RAYTRACING_SIMD_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_AVX 1
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE 1
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 4
+#endif
+
+// result of a lane-wise comparison
+struct SimdMask
+{
+#if defined(SIMD_AVX)
+    __m256 m;
+    explicit SimdMask(__m256 x) : m(x) {}
+    int bits() const { return _mm256_movemask_ps(m); }
+    SimdMask operator & (const SimdMask &o) const { return SimdMask(_mm256_and_ps(m, o.m)); }
+    SimdMask operator | (const SimdMask &o) const { return SimdMask(_mm256_or_ps(m, o.m)); }
+#elif defined(SIMD_SSE)
+    __m128 m;
+    explicit SimdMask(__m128 x) : m(x) {}
+    int bits() const { return _mm_movemask_ps(m); }
+    SimdMask operator & (const SimdMask &o) const { return SimdMask(_mm_and_ps(m, o.m)); }
+    SimdMask operator | (const SimdMask &o) const { return SimdMask(_mm_or_ps(m, o.m)); }
+#else
+    int m;
+    explicit SimdMask(int x) : m(x) {}
+    int bits() const { return m; }
+    SimdMask operator & (const SimdMask &o) const { return SimdMask(m & o.m); }
+    SimdMask operator | (const SimdMask &o) const { return SimdMask(m | o.m); }
+#endif
+    bool any() const { return bits() != 0; }
+};
+
+struct SimdFloat
+{
+#if defined(SIMD_AVX)
+    __m256 v;
+    SimdFloat() {}
+    explicit SimdFloat(__m256 x) : v(x) {}
+    SimdFloat(float f) : v(_mm256_set1_ps(f)) {}
+    static SimdFloat load(const float *p) { return SimdFloat(_mm256_loadu_ps(p)); }
+    // SIMD_WIDTH unsigned bytes widened to floats, AVX has no 256 bit integer unpacking so two halves are joined
+    static SimdFloat loadBytes(const uint8_t *p)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+        __m256i ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(words, zero)),
+                                               _mm_unpackhi_epi16(words, zero), 1);
+        return SimdFloat(_mm256_cvtepi32_ps(ints));
+    }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    SimdFloat operator + (const SimdFloat &o) const { return SimdFloat(_mm256_add_ps(v, o.v)); }
+    SimdFloat operator - (const SimdFloat &o) const { return SimdFloat(_mm256_sub_ps(v, o.v)); }
+    SimdFloat operator * (const SimdFloat &o) const { return SimdFloat(_mm256_mul_ps(v, o.v)); }
+    SimdFloat operator / (const SimdFloat &o) const { return SimdFloat(_mm256_div_ps(v, o.v)); }
+    SimdMask operator < (const SimdFloat &o) const { return SimdMask(_mm256_cmp_ps(v, o.v, _CMP_LT_OQ)); }
+    SimdMask operator <= (const SimdFloat &o) const { return SimdMask(_mm256_cmp_ps(v, o.v, _CMP_LE_OQ)); }
+    SimdMask operator > (const SimdFloat &o) const { return SimdMask(_mm256_cmp_ps(v, o.v, _CMP_GT_OQ)); }
+    SimdMask operator >= (const SimdFloat &o) const { return SimdMask(_mm256_cmp_ps(v, o.v, _CMP_GE_OQ)); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm256_min_ps(a.v, b.v)); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm256_max_ps(a.v, b.v)); }
+    // lanes where mask is set come from a, the others from b
+    friend SimdFloat select(const SimdMask &mask, const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm256_blendv_ps(b.v, a.v, mask.m)); }
+#elif defined(SIMD_SSE)
+    __m128 v;
+    SimdFloat() {}
+    explicit SimdFloat(__m128 x) : v(x) {}
+    SimdFloat(float f) : v(_mm_set1_ps(f)) {}
+    static SimdFloat load(const float *p) { return SimdFloat(_mm_loadu_ps(p)); }
+    // SIMD_WIDTH unsigned bytes widened to floats
+    static SimdFloat loadBytes(const uint8_t *p)
+    {
+        int32_t bytes;
+        std::memcpy(&bytes, p, sizeof(bytes));
+        __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return SimdFloat(_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)));
+    }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    SimdFloat operator + (const SimdFloat &o) const { return SimdFloat(_mm_add_ps(v, o.v)); }
+    SimdFloat operator - (const SimdFloat &o) const { return SimdFloat(_mm_sub_ps(v, o.v)); }
+    SimdFloat operator * (const SimdFloat &o) const { return SimdFloat(_mm_mul_ps(v, o.v)); }
+    SimdFloat operator / (const SimdFloat &o) const { return SimdFloat(_mm_div_ps(v, o.v)); }
+    SimdMask operator < (const SimdFloat &o) const { return SimdMask(_mm_cmplt_ps(v, o.v)); }
+    SimdMask operator <= (const SimdFloat &o) const { return SimdMask(_mm_cmple_ps(v, o.v)); }
+    SimdMask operator > (const SimdFloat &o) const { return SimdMask(_mm_cmpgt_ps(v, o.v)); }
+    SimdMask operator >= (const SimdFloat &o) const { return SimdMask(_mm_cmpge_ps(v, o.v)); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm_min_ps(a.v, b.v)); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm_max_ps(a.v, b.v)); }
+    // lanes where mask is set come from a, the others from b
+    friend SimdFloat select(const SimdMask &mask, const SimdFloat &a, const SimdFloat &b) { return SimdFloat(_mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v))); }
+#else
+    float v[SIMD_WIDTH];
+    SimdFloat() {}
+    SimdFloat(float f) { for (int i = 0; i < SIMD_WIDTH; ++i) v[i] = f; }
+    static SimdFloat load(const float *p) { SimdFloat r; for (int i = 0; i < SIMD_WIDTH; ++i) r.v[i] = p[i]; return r; }
+    static SimdFloat loadBytes(const uint8_t *p) { SimdFloat r; for (int i = 0; i < SIMD_WIDTH; ++i) r.v[i] = p[i]; return r; }
+    void store(float *p) const { for (int i = 0; i < SIMD_WIDTH; ++i) p[i] = v[i]; }
+
+    template <typename F> static SimdFloat apply(const SimdFloat &a, const SimdFloat &b, F f)
+    { SimdFloat r; for (int i = 0; i < SIMD_WIDTH; ++i) r.v[i] = f(a.v[i], b.v[i]); return r; }
+    template <typename F> static SimdMask compare(const SimdFloat &a, const SimdFloat &b, F f)
+    { int bits = 0; for (int i = 0; i < SIMD_WIDTH; ++i) bits |= f(a.v[i], b.v[i]) ? (1 << i) : 0; return SimdMask(bits); }
+
+    SimdFloat operator + (const SimdFloat &o) const { return apply(*this, o, [](float a, float b) { return a + b; }); }
+    SimdFloat operator - (const SimdFloat &o) const { return apply(*this, o, [](float a, float b) { return a - b; }); }
+    SimdFloat operator * (const SimdFloat &o) const { return apply(*this, o, [](float a, float b) { return a * b; }); }
+    SimdFloat operator / (const SimdFloat &o) const { return apply(*this, o, [](float a, float b) { return a / b; }); }
+    SimdMask operator < (const SimdFloat &o) const { return compare(*this, o, [](float a, float b) { return a < b; }); }
+    SimdMask operator <= (const SimdFloat &o) const { return compare(*this, o, [](float a, float b) { return a <= b; }); }
+    SimdMask operator > (const SimdFloat &o) const { return compare(*this, o, [](float a, float b) { return a > b; }); }
+    SimdMask operator >= (const SimdFloat &o) const { return compare(*this, o, [](float a, float b) { return a >= b; }); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return apply(a, b, [](float x, float y) { return y < x ? y : x; }); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return apply(a, b, [](float x, float y) { return x < y ? y : x; }); }
+    // lanes where mask is set come from a, the others from b
+    friend SimdFloat select(const SimdMask &mask, const SimdFloat &a, const SimdFloat &b)
+    { SimdFloat r; for (int i = 0; i < SIMD_WIDTH; ++i) r.v[i] = (mask.m >> i) & 1 ? a.v[i] : b.v[i]; return r; }
+#endif
+};
+
+#endif //RAYTRACING_SIMD_H
@@ -2,12 +2,55 @@
 // Created by Göksu Güvendiren on 2019-05-14.
 //
 
+#include <algorithm>
+#include <chrono>
 #include "Scene.hpp"
+#include "Triangle.hpp"
+#include "Instance.hpp"
 
 void Scene::buildBVH()
 {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, maxPrimsInNode, splitMethod);
+    this->bvh->optimize(optimizeTimeBudget);
+    if (compressedNodes)
+        this->bvh->compressNodes();
+}
+
+int Scene::refit(float rebuildCostRatio)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<MeshTriangle*> meshes;
+    std::vector<Instance*> instances;
+    for (Object* object : objects)
+    {
+        MeshTriangle* mesh = dynamic_cast<MeshTriangle*>(object);
+        Instance* instance = dynamic_cast<Instance*>(object);
+        if (instance)
+        {
+            instances.push_back(instance);
+            mesh = instance->mesh;
+        }
+        if (mesh && std::find(meshes.begin(), meshes.end(), mesh) == meshes.end())
+            meshes.push_back(mesh);
+    }
+
+    int rebuilt = 0;
+    for (MeshTriangle* mesh : meshes)
+    {
+        rebuilt += mesh->refit(rebuildCostRatio);
+    }
+    // an instance's world bounds come from its mesh's, which only now are up to date
+    for (Instance* instance : instances)
+    {
+        instance->setTransform(instance->toWorld);
+    }
+    rebuilt += bvh->refit(rebuildCostRatio);
+    buildLightDistribution();
+
+    printf("Scene refit: %i meshes and the scene BVH in %.1f ms, %i rebuilt\n", (int)meshes.size(),
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), rebuilt);
+    return rebuilt;
 }
 
 Intersection Scene::getIntersect(const Ray &ray) const
@@ -15,58 +58,124 @@ Intersection Scene::getIntersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection & pos, float & pdf) const
+bool Scene::isOccluded(const Ray &ray) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
-    }
+    return this->bvh->IntersectP(ray);
 }
 
+void Scene::sampleLight(Intersection & pos, float & pdf) const
+{
+    pdf = 0.0f;
+    if (emitterDistribution.empty())
+        return;
+    float pmf = 0.0f;
+    float u1 = get_random_float(), u2 = get_random_float();
+    Object* emitter = emitters[emitterDistribution.sample(u1, u2, pmf)];
+    emitter->Sample(pos, pdf);
+    pdf *= pmf;//Sample is uniform over the emitter's own area
+}
 
+float Scene::pdfLight(const Intersection &lightPoint) const
+{
+    if (!lightPoint.happened || lightPoint.obj == nullptr)
+        return 0.0f;
+    auto found = emitterIndex.find(lightPoint.obj);
+    if (found == emitterIndex.end())
+        return 0.0f;
+    return emitterDistribution.pmf(found->second) / emitters[found->second]->getArea();
+}
 
-void Scene::JingzSampleLight(Intersection& result_pos, float& result_pdf) const
+void Scene::sampleLight(const Intersection &ref, Intersection &pos, float &pdf) const
 {
-    float p = 1.0f * lights_emit_area_sum;//由总面积生成阈值作为有效门槛
-    //float p = get_random_float() * lights_emit_area_sum;//由总面积生成阈值作为有效门槛
-    float cur_emit_area_sum = 0.0f;
-    for (uint32_t k = 0; k < objects.size(); ++k)
+    if (!useLightBVH)
     {
-        if (objects[k]->hasEmit())
-        {
-            //每次累计一定面积超过随机阈值概率才采样生成采样点和概率密度?
-            cur_emit_area_sum += objects[k]->getArea();
-            if (cur_emit_area_sum >= p)
-            {
-                objects[k]->Sample(result_pos, result_pdf);
-                break;
-            }
-        }
+        sampleLight(pos, pdf);
+        return;
     }
+    if (!lightBVH.sample(ref, pos, pdf))
+        pdf = 0.0f;
+}
+
+float Scene::pdfLight(const Intersection &ref, const Intersection &lightPoint) const
+{
+    return useLightBVH ? lightBVH.pdf(ref, lightPoint) : pdfLight(lightPoint);
+}
+
+void Scene::JingzSampleLight(Intersection& result_pos, float& result_pdf) const
+{
+    //原先用总面积作为固定阈值，永远只会选中最后一个光源，现在和sampleLight一样按分布表抽取
+    sampleLight(result_pos, result_pdf);
 }
 
-void Scene::calculateLightEmitArea()//扫描场景内所有物体，累计有效发光区域面积
+void Scene::buildLightDistribution()//扫描场景内所有物体，累计有效发光区域面积，并建立按功率或面积抽取光源的分布表
 {
+    emitters.clear();
+    emitterIndex.clear();
+    lights_emit_area_sum = 0.0f;
+    std::vector<float> weights;
+    std::vector<LightPrimitive> lightPrimitives;
     for (uint32_t k = 0; k < objects.size(); ++k)
     {
         if (objects[k]->hasEmit())
         {
-            lights_emit_area_sum += objects[k]->getArea();
+            float area = objects[k]->getArea();
+            lights_emit_area_sum += area;
+
+            // the emission is constant over the surface, so power is proportional to area times radiance.
+            // Object has no emission accessor, a sample point carries it
+            Intersection radiance;
+            float pdf = 0.0f;
+            objects[k]->Sample(radiance, pdf);
+            Vector3f e = radiance.emit;
+            float luminance = 0.2126f * e.x + 0.7152f * e.y + 0.0722f * e.z;
+
+            emitterIndex[objects[k]] = (int)emitters.size();
+            emitters.push_back(objects[k]);
+            weights.push_back(sampleLightsByPower ? area * luminance : area);
+
+            // the light BVH sees every triangle of an emissive mesh or instance on its own, in mesh order
+            MeshTriangle* mesh = dynamic_cast<MeshTriangle*>(objects[k]);
+            Instance* instance = dynamic_cast<Instance*>(objects[k]);
+            uint32_t triangleCount = mesh ? mesh->numTriangles : (instance ? instance->mesh->numTriangles : 1);
+            for (uint32_t t = 0; t < triangleCount; ++t)
+            {
+                LightPrimitive light;
+                light.object = objects[k];
+                light.triangle = mesh || instance ? (int)t : -1;
+                light.emit = e;
+                if (mesh || instance)
+                {
+                    if (instance)
+                    {
+                        instance->worldTriangle(t, light.v0, light.v1, light.v2);
+                    }
+                    else
+                    {
+                        light.v0 = mesh->vertices[mesh->vertexIndex[t * 3]];
+                        light.v1 = mesh->vertices[mesh->vertexIndex[t * 3 + 1]];
+                        light.v2 = mesh->vertices[mesh->vertexIndex[t * 3 + 2]];
+                    }
+                    Vector3f n = crossProduct(light.v1 - light.v0, light.v2 - light.v0);
+                    light.area = 0.5f * std::sqrt(dotProduct(n, n));
+                    light.lightBounds.bounds = Union(Bounds3(light.v0, light.v1), light.v2);
+                    light.lightBounds.axis = light.area > 0.0f ? normalize(n) : Vector3f(0.0f, 0.0f, 1.0f);
+                    light.lightBounds.cosThetaO = 1.0f;
+                }
+                else
+                {
+                    // no orientation known, emits in every direction
+                    light.area = area;
+                    light.lightBounds.bounds = objects[k]->getBounds();
+                    light.lightBounds.axis = Vector3f(0.0f, 0.0f, 1.0f);
+                    light.lightBounds.cosThetaO = -1.0f;
+                }
+                light.lightBounds.power = light.area * luminance;
+                lightPrimitives.push_back(light);
+            }
         }
     }
+    emitterDistribution.build(weights);
+    lightBVH.build(std::move(lightPrimitives));
 }
 
 bool Scene::trace(
@@ -91,7 +200,18 @@ bool Scene::trace(
     return (*hitObject != nullptr);
 }
 
+// power heuristic weight for a sample drawn with pdf fPdf when the other strategy would have drawn it with gPdf
+static float powerHeuristic(float fPdf, float gPdf)
+{
+    float f2 = fPdf * fPdf, g2 = gPdf * gPdf;
+    return f2 + g2 > 0.0f ? f2 / (f2 + g2) : 0.0f;
+}
+
 // Implementation of Path Tracing
+// Iterative: throughput carries the product of f_r * cos / pdf along the path, and the
+// intersection found for a bounce ray is the next path vertex, so every ray is traced once.
+// Direct light is next event estimation combined with the emitters the bounce rays hit,
+// both weighted by multiple importance sampling
 Vector3f Scene::castRay(const Ray &ray, int depth) const
 {
     // TO DO Implement Path Tracing Algorithm here
@@ -104,52 +224,75 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         return intersection.pMaterial->getEmission();
     }
 
+    Vector3f L(0.0f, 0.0f, 0.0f);
+    Vector3f throughput(1.0f, 1.0f, 1.0f);
     Vector3f wo = ray.direction;//镜头射线的入射方向,但我们计算利用光路可逆性来计算，属于wo
-    Vector3f L_direct_factor(0.0f, 0.0f, 0.0f);
-
-    Intersection inter_L_direct;
-    float pdf_light = 0.0f;
-    // 在场景的所有光源上按面积 uniform 地 sampley一个，并计算该sample地概率密度
-    JingzSampleLight(inter_L_direct, pdf_light);
-    Vector3f lightPos = inter_L_direct.coords;//把光源限定在一个标准几何面元的几何表中心处
+    for (;; ++depth)
+    {
+        Material* material = intersection.pMaterial;
+        Vector3f curPos = intersection.coords;//场景内要与光线求教的位置
 
-    Vector3f curPos = intersection.coords;//场景内要与光线求教的位置
-    Vector3f tempToLight = (lightPos - curPos);
-    Vector3f wi = tempToLight.normalized();
+        Intersection inter_L_direct;
+        float pdf_light = 0.0f;
+        // 在场景的所有光源上按面积 uniform 地 sampley一个，并计算该sample地概率密度
+        sampleLight(intersection, inter_L_direct, pdf_light);
+        Vector3f lightPos = inter_L_direct.coords;//把光源限定在一个标准几何面元的几何表中心处
 
-    Ray curPos_2_light_ray(curPos, wi);
-    Intersection curPos_2_light_inter = getIntersect(curPos_2_light_ray);
-    //return curPos_2_light_inter.normal;
+        Vector3f tempToLight = (lightPos - curPos);
+        Vector3f wi = tempToLight.normalized();
+        float cosLight = dotProduct(-wi, inter_L_direct.normal);
 
-    if (curPos_2_light_inter.distance - (lightPos - curPos).norm() > -0.005f)//与发光面元中心距离属于合理误差内，计算直接光照
-    {
-        //L_direct_factor = Vector3f(0.1f, 0.0f, 0.0f);
-        Vector3f f_r = intersection.pMaterial->eval(wo, wi, intersection.normal);
-        float distance2_inv = 1.0f / dotProduct(tempToLight, tempToLight);//距离衰减部分系数
-        L_direct_factor = inter_L_direct.emit * f_r * dotProduct(wi, intersection.normal) * dotProduct(-wi, inter_L_direct.normal) * distance2_inv / pdf_light;
-    }
+        Ray curPos_2_light_ray(curPos, wi);
+        curPos_2_light_ray.t_max = tempToLight.norm() - 0.005f;//stop just short of the sampled light point
 
-    //间接光，在漫反射物体上计算间接光照部分，假设所有非漫射物体都是镜面反射，可以考虑增加漫反射弹射次层数
-    Vector3f L_indir_factor(0.0f, 0.0f, 0.0f);
-    {
-        if (get_random_float() > RussianRoulette)//赌输了就没有间接光照衍生的射线
+        if (pdf_light > 0.0f && cosLight > 0.0f && !isOccluded(curPos_2_light_ray))//与发光面元中心距离属于合理误差内，计算直接光照
         {
-            return L_direct_factor;
+            Vector3f f_r = material->eval(wo, wi, intersection.normal);
+            float distance2 = dotProduct(tempToLight, tempToLight);//距离衰减部分系数
+            float pdf_light_solidAngle = pdf_light * distance2 / cosLight;
+            float weight = powerHeuristic(pdf_light_solidAngle, material->pdf(wo, wi, intersection.normal));
+            L += throughput * inter_L_direct.emit * f_r * dotProduct(wi, intersection.normal) * weight / pdf_light_solidAngle;
         }
 
         // 按照该材质的性质，给定入射方向和法向量，用某种分布采样一个出射方向
-        Vector3f wo2 = (intersection.pMaterial->sample(wo, intersection.normal)).normalized();
+        Vector3f wo2 = material->sample(wo, intersection.normal).normalized();
+        // 给定一对入射、出射方向和法向量，计算sample方法得到该出射方向的概率密度
+        float pdf = material->pdf(wo, wo2, intersection.normal);
+        if (pdf <= 0.0f)
+            break;
+        throughput = throughput * material->eval(wo, wo2, intersection.normal) * dotProduct(wo2, intersection.normal) / pdf;
+
+        //赌输了就没有间接光照衍生的射线，前几次弹射总是继续，之后按路径剩余的贡献决定存活概率
+        //在追踪弹射射线之前决定，输掉的路径不必再做一次求交
+        if (depth >= minRRDepth)
+        {
+            float survival = std::min(RussianRoulette, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+            if (get_random_float() >= survival)
+                break;
+            throughput = throughput / survival;
+        }
 
         Ray ray_indir(curPos, wo2);
         Intersection inter_L_indirect = getIntersect(ray_indir);
-        if (inter_L_indirect.happened && !inter_L_indirect.pMaterial->hasEmission())//非直接光源
+        if (!inter_L_indirect.happened)
+            break;
+
+        //打到光源：按光源采样同样能得到这个点的概率做MIS加权，路径结束
+        if (inter_L_indirect.pMaterial->hasEmission())
         {
-            // 给定一对入射、出射方向和法向量，计算sample方法得到该出射方向的概率密度
-            float pdf = inter_L_indirect.pMaterial->pdf(wo, wo2, intersection.normal);
-            L_indir_factor = castRay(ray_indir, depth + 1)
-                * (inter_L_indirect.pMaterial->eval(wo, wo2, intersection.normal) * dotProduct(wo2, intersection.normal) / pdf / RussianRoulette);
+            float cosHit = dotProduct(-wo2, inter_L_indirect.normal);
+            if (cosHit > 0.0f)
+            {
+                float distance = inter_L_indirect.distance;
+                float pdf_light_solidAngle = pdfLight(intersection, inter_L_indirect) * distance * distance / cosHit;
+                L += throughput * inter_L_indirect.pMaterial->getEmission() * powerHeuristic(pdf, pdf_light_solidAngle);
+            }
+            break;
         }
+
+        intersection = inter_L_indirect;
+        wo = wo2;
     }
 
-    return L_direct_factor + L_indir_factor;
-}
\ No newline at end of file
+    return L;
+}
@@ -5,11 +5,14 @@
 #pragma once
 
 #include <vector>
+#include <unordered_map>
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "AliasTable.hpp"
+#include "LightBVH.hpp"
 #include "Ray.hpp"
 
 
@@ -22,7 +25,18 @@ public:
     double fov = 40;
     Vector3f backgroundColor = Vector3f(0.235294f, 0.67451f, 0.843137f);
     int maxDepth = 1;
-    float RussianRoulette = 0.8f;
+    float RussianRoulette = 0.8f;// highest probability a path survives Russian roulette
+    int minRRDepth = 3;// bounces every path gets before Russian roulette starts
+    bool sampleLightsByPower = true;// pick emitters by emitted power, otherwise by area
+    // pick emissive triangles by their estimated contribution to the shading point. Costs about
+    // 16 importance evaluations per light sample, so it only pays off when most lights barely reach most points
+    bool useLightBVH = false;
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+    int maxPrimsInNode = 1;
+    // 8 bit child boxes in every BVH, half the node memory for a few percent more box tests
+    bool compressedNodes = false;
+    // seconds BVHAccel::optimize may spend on each BVH, 0 skips it
+    double optimizeTimeBudget = 0.0;
 
     Scene(int w, int h) : width(w), height(h), lights_emit_area_sum(0.0f)
     {}
@@ -33,12 +47,21 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection getIntersect(const Ray& ray) const;
+    bool isOccluded(const Ray& ray) const;//any hit between ray.t_min and ray.t_max
     BVHAccel *bvh;
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+    float pdfLight(const Intersection &lightPoint) const;//area density sampleLight picks this point with
+    // same for a shading point ref, through the light BVH when it is enabled
+    void sampleLight(const Intersection &ref, Intersection &pos, float &pdf) const;
+    float pdfLight(const Intersection &ref, const Intersection &lightPoint) const;
     void JingzSampleLight(Intersection & result_pos, float & result_pdf) const;
-    void calculateLightEmitArea();//jingz 预先计算场景所有光照对象有效自发光面积
+    // after vertices of meshes moved or instances' toWorld changed: refits every mesh BVH, meshes only
+    // reached through instances included, applies the instances' transforms again for their bounds and areas, refits the scene BVH
+    // and builds the light distribution again. Returns how many of the BVHs were rebuilt instead
+    int refit(float rebuildCostRatio = 1.5f);
+    void buildLightDistribution();//jingz 预先计算场景所有光照对象有效自发光面积, call once after buildBVH
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -49,6 +72,10 @@ public:
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
     float lights_emit_area_sum = 0.0f;//jingz
+    std::vector<Object*> emitters;
+    AliasTable emitterDistribution;//picks an entry of emitters
+    std::unordered_map<const Object*, int> emitterIndex;
+    LightBVH lightBVH;
 
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
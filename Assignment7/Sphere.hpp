@@ -26,8 +26,8 @@ public:
         float t0, t1;
         float area = 4 * M_PI * radius2;
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
+        if (t0 < ray.t_min) t0 = t1;
+        if (t0 < ray.t_min || t0 > ray.t_max) return false;
         return true;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
@@ -56,7 +56,7 @@ public:
         float t0, t1;
         if (!solveQuadratic(a, b, c, t0, t1)) return result;
         if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        if (t0 < 0 || t0 > ray.t_max) return result;
         result.happened=true;
 
         result.coords = Vector3f(ray.origin + ray.direction * t0);
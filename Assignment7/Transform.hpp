@@ -0,0 +1,127 @@
+//
+// Affine transform for placing instances, stored as the top three rows of a 4x4 matrix.
+//
+
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+struct Transform
+{
+    float m[3][4];// m[row][3] is the translation
+
+    Transform()
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = i == j ? 1.0f : 0.0f;
+    }
+
+    static Transform translate(const Vector3f& t)
+    {
+        Transform result;
+        result.m[0][3] = t.x; result.m[1][3] = t.y; result.m[2][3] = t.z;
+        return result;
+    }
+
+    // a negative factor mirrors, see Instance about what that does to the winding
+    static Transform scale(const Vector3f& s)
+    {
+        Transform result;
+        result.m[0][0] = s.x; result.m[1][1] = s.y; result.m[2][2] = s.z;
+        return result;
+    }
+
+    static Transform rotateY(float degrees)
+    {
+        float radians = degrees * M_PI / 180.0f;
+        float c = std::cos(radians), s = std::sin(radians);
+        Transform result;
+        result.m[0][0] = c;  result.m[0][2] = s;
+        result.m[2][0] = -s; result.m[2][2] = c;
+        return result;
+    }
+
+    // t is applied first
+    Transform operator*(const Transform& t) const
+    {
+        Transform result;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                result.m[i][j] = m[i][0] * t.m[0][j] + m[i][1] * t.m[1][j] + m[i][2] * t.m[2][j] + (j == 3 ? m[i][3] : 0.0f);
+            }
+        }
+        return result;
+    }
+
+    // of the linear part, negative when the transform mirrors
+    float determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+             - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+             + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // the linear part inverted by cofactors, the translation undone afterwards
+    Transform inverse() const
+    {
+        Transform result;
+        float invDet = 1.0f / determinant();
+        for (int i = 0; i < 3; ++i)
+        {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            for (int j = 0; j < 3; ++j)
+            {
+                int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                result.m[j][i] = (m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1]) * invDet;
+            }
+        }
+        for (int i = 0; i < 3; ++i)
+        {
+            result.m[i][3] = -(result.m[i][0] * m[0][3] + result.m[i][1] * m[1][3] + result.m[i][2] * m[2][3]);
+        }
+        return result;
+    }
+
+    Vector3f point(const Vector3f& p) const
+    {
+        return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f vector(const Vector3f& v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // multiplies by the transposed linear part. Normals move with the inverse transpose,
+    // so the inverse of a transform carries them the way the transform carries points
+    Vector3f transposedVector(const Vector3f& v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                        m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                        m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+
+    // box around the transformed corners of b
+    Bounds3 bounds(const Bounds3& b) const
+    {
+        Bounds3 result;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            Vector3f p((corner & 1) ? b.pMax.x : b.pMin.x, (corner & 2) ? b.pMax.y : b.pMin.y,
+                       (corner & 4) ? b.pMax.z : b.pMin.z);
+            result = Union(result, point(p));
+        }
+        return result;
+    }
+};
+
+#endif //RAYTRACING_TRANSFORM_H
@@ -1,15 +1,16 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
-#include <array>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -41,7 +42,8 @@ bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
 
 
 #define TEMP_EPSILON 1e-6
-bool rayTriangleIntersect_MollerTrumbore(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, 
+// E1 = v1 - v0 and E2 = v2 - v0 are passed in so callers can reuse cached edges
+inline bool rayTriangleIntersect_MollerTrumbore(const Vector3f& v0, const Vector3f& E1, const Vector3f& E2,
     const Vector3f& orig,const Vector3f& dir, float& tnear, float& u, float& v)
 {
     //{
@@ -79,13 +81,13 @@ bool rayTriangleIntersect_MollerTrumbore(const Vector3f& v0, const Vector3f& v1,
     // origin is *orig* and direction is *dir*)
     // Also don't forget to update tnear, u and v.
 
-    Vector3f E1 = v1 - v0;
-    Vector3f E2 = v2 - v0;
-
     Vector3f S1 = crossProduct(dir, E2);//p,2ƽķ___ĳã
     float E1S1 = dotProduct(E1,S1);//det
     //ƽƽ
-    if (abs(E1S1) <= TEMP_EPSILON)//ķΪ0󷽳޽
+    //E1S1 < 0 means the ray sees the back face; rays leaving a surface do, so culling them avoids self hits.
+    //E1S1 grows with the edge lengths and the direction length, a fixed epsilon hid every face of small meshes
+    //such as the bunny, and of instances whose mesh space rays are short
+    if (E1S1 <= 0.0f)//ķΪ0󷽳޽
     {
         return false;
     }
@@ -99,23 +101,16 @@ bool rayTriangleIntersect_MollerTrumbore(const Vector3f& v0, const Vector3f& v1,
         return false;
     }
 
-    float S_S1 = dotProduct(S,S1);
-    if (S_S1 < 0.0f)
+    u = dotProduct(S,S1) * inv_E1S1;
+    if (u < 0.0f || u > 1.0f)
         return false;
 
-    float dir_S2 = dotProduct(dir,S2);
-    if (dir_S2 < 0.0f)
+    v = dotProduct(dir,S2) * inv_E1S1;
+    if (v < 0.0f || u + v > 1.0f)
         return false;
 
-    u = S_S1 * inv_E1S1;
-    v = dir_S2 * inv_E1S1;
-    if (1.0f > u && 1.0f > v && (1 - u - v) >= TEMP_EPSILON)
-    {
-        tnear = t;
-        return true;
-    }
-
-    return false;
+    tnear = t;
+    return true;
 }
 
 class Triangle : public Object
@@ -171,56 +166,176 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    // optimizeTimeBudget > 0 runs BVHAccel::optimize for that many seconds after the build
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH, int maxPrimsInNode = SIMD_WIDTH,
+                 double optimizeTimeBudget = 0.0)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
         area = 0;
         pMaterial = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        bvh = nullptr;
+
+        // the recorded hit path walks the BVH build tree, which a cache does not keep. Neither is an optimized
+        // tree cached, what it looks like depends on the time it got
+#ifndef RECORD_RAY_HIT_PATH
+        std::string cacheFilename = filename + ".bvhcache";
+        uint64_t sourceHash = 0;
+        bool hashed = optimizeTimeBudget <= 0.0 && hashFile(filename, sourceHash);
+        if (hashed && loadCache(cacheFilename, sourceHash, splitMethod, maxPrimsInNode))
+        {
+            computeBoundsAndArea();
+            return;
+        }
+#endif
+
+        loadObj(filename);
+        computeBoundsAndArea();
+        bvh = new BVHAccel(this, mt, vertices.data(), vertexIndex.data(), numTriangles, maxPrimsInNode, splitMethod);
+        bvh->optimize(optimizeTimeBudget);
+
+#ifndef RECORD_RAY_HIT_PATH
+        if (hashed && !saveCache(cacheFilename, sourceHash, splitMethod, maxPrimsInNode))
+        {
+            std::cout << "Could not write mesh cache " << cacheFilename << "\n";
+        }
+#endif
+    }
+
+    void loadObj(const std::string& filename)
+    {
+        ObjMesh mesh;
+        if (!::loadObj(filename, mesh))
+        {
+            std::cout << "Could not read " << filename << "\n";
+        }
+        else if (mesh.skippedFaces > 0)
+        {
+            std::cout << filename << ": skipped " << mesh.skippedFaces << " faces with missing vertices\n";
+        }
+        vertices = std::move(mesh.vertices);
+        stCoordinates = std::move(mesh.stCoordinates);
+        vertexIndex = std::move(mesh.vertexIndex);
+        numVertices = (uint32_t)vertices.size();
+        numTriangles = (uint32_t)(vertexIndex.size() / 3);
+    }
+
+    // call after moving vertices in place, the triangles staying the same: bounds, area and the BVH follow.
+    // true when the BVH was rebuilt rather than refitted, see BVHAccel::refit
+    bool refit(float rebuildCostRatio = 1.5f)
+    {
+        computeBoundsAndArea();
+        return bvh && bvh->refit(rebuildCostRatio);
+    }
 
+    void computeBoundsAndArea()
+    {
+        area = 0;
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity()};
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3)
+        for (uint32_t i = 0; i < numVertices; ++i)
         {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++)
-            {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+            min_vert = Vector3f::Min(min_vert, vertices[i]);
+            max_vert = Vector3f::Max(max_vert, vertices[i]);
+        }
+        std::vector<float> triangleAreas(numTriangles);
+        for (uint32_t k = 0; k < numTriangles; ++k)
+        {
+            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
+            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
+            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+            triangleAreas[k] = crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+            area += triangleAreas[k];
+        }
+        if (pMaterial->hasEmission())//only lights are sampled
+        {
+            triangleDistribution.build(triangleAreas);
         }
 
         bounding_box = Bounds3(min_vert, max_vert);
+    }
+
+    // Cache layout: MeshCacheHeader, vertices, texture coordinates, vertex indices, then the BVH arrays.
+    // The material is not stored, the mesh keeps the one it is constructed with
+    bool loadCache(const std::string& cacheFilename, uint64_t sourceHash,
+                   BVHAccel::SplitMethod splitMethod, int maxPrimsInNode)
+    {
+        MappedFile file(cacheFilename);
+        if (!file.valid())
+            return false;
+        CacheReader cache(file.data(), file.size());
+        MeshCacheHeader header;
+        if (!cache.read(header) || memcmp(header.magic, "PA7MESH", 8) != 0 || header.version != MESH_CACHE_VERSION
+            || header.simdWidth != SIMD_WIDTH || header.sourceHash != sourceHash
+            || header.splitMethod != (int32_t)splitMethod || header.maxPrimsInNode != maxPrimsInNode
+            || header.fileSize != file.size())
+            return false;
+
+        // a damaged header must not make us allocate more than the file could hold
+        uint64_t meshBytes = (uint64_t)header.numVertices * (sizeof(Vector3f) + sizeof(Vector2f))
+            + (uint64_t)header.numTriangles * 3 * sizeof(uint32_t);
+        if (meshBytes > file.size())
+            return false;
+        numVertices = header.numVertices;
+        numTriangles = header.numTriangles;
+        vertices.resize(numVertices);
+        stCoordinates.resize(numVertices);
+        vertexIndex.resize(numTriangles * 3);
+        cache.read(vertices.data(), numVertices);
+        cache.read(stCoordinates.data(), numVertices);
+        cache.read(vertexIndex.data(), numTriangles * 3);
+        if (!cache.ok())
+            return false;
+        for (uint32_t i = 0; i < numTriangles * 3; ++i)
+        {
+            if (vertexIndex[i] >= numVertices)
+                return false;
+        }
 
-        std::vector<Object *> ptrs;
-        for (auto &tri : triangles)
+        bvh = new BVHAccel(this, pMaterial, vertices.data(), vertexIndex.data(), numTriangles, maxPrimsInNode,
+                           splitMethod, cache);
+        if (!cache.ok() || !cache.atEnd() || bvh->wideNodes.empty())
         {
-            ptrs.push_back(&tri);
-            area += tri.area;
+            delete bvh;
+            bvh = nullptr;
+            return false;
         }
-        bvh = new BVHAccel(ptrs);
+        return true;
+    }
+
+    bool saveCache(const std::string& cacheFilename, uint64_t sourceHash,
+                   BVHAccel::SplitMethod splitMethod, int maxPrimsInNode) const
+    {
+        if (!bvh || bvh->wideNodes.empty())
+            return false;
+        MeshCacheHeader header = {};
+        memcpy(header.magic, "PA7MESH", 8);
+        header.version = MESH_CACHE_VERSION;
+        header.simdWidth = SIMD_WIDTH;
+        header.sourceHash = sourceHash;
+        header.splitMethod = (int32_t)splitMethod;
+        header.maxPrimsInNode = maxPrimsInNode;
+        header.numVertices = numVertices;
+        header.numTriangles = numTriangles;
+
+        CacheWriter cache(cacheFilename);
+        cache.write(header);
+        cache.write(vertices.data(), numVertices);
+        cache.write(stCoordinates.data(), numVertices);
+        cache.write(vertexIndex.data(), numTriangles * 3);
+        bvh->writeCache(cache);
+        // the size is only known once everything is written
+        header.fileSize = (uint64_t)cache.position();
+        cache.rewind();
+        cache.write(header);
+        return cache.finish();
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    // any-hit query inside [ray.t_min, ray.t_max], used for shadow rays
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
     {
@@ -232,7 +347,7 @@ public:
             const Vector3f &v2 = vertices[vertexIndex[k * 3 + 2]];
             float t, u, v;
             //ܺģ͵Ķֻཻȡһ rayTriangleIntersect_MollerTrumbore
-            if (rayTriangleIntersect_MollerTrumbore(v0, v1, v2, ray.origin, ray.direction, t,u, v) &&
+            if (rayTriangleIntersect_MollerTrumbore(v0, v1 - v0, v2 - v0, ray.origin, ray.direction, t,u, v) &&
                 t < tnear)
             {//jingz
                 tnear = t;
@@ -283,10 +398,22 @@ public:
         return intersec;
     }
 
+    // uniform over the mesh area: a triangle by its share of the area, then uniform inside it
     void Sample(Intersection &pos, float &pdf)
     {
-        bvh->Sample(pos, pdf);
+        float pmf = 0.0f;
+        float u1 = get_random_float(), u2 = get_random_float();
+        uint32_t k = triangleDistribution.empty() ? 0 : triangleDistribution.sample(u1, u2, pmf);
+        const Vector3f& v0 = vertices[vertexIndex[k * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+        float x = std::sqrt(get_random_float()), y = get_random_float();
+        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+        pos.normal = normalize(crossProduct(v1 - v0, v2 - v0));
         pos.emit = pMaterial->getEmission();
+        pos.obj = this;
+        pos.pMaterial = pMaterial;
+        pdf = 1.0f / area;
     }
     float getArea()
     {
@@ -299,12 +426,12 @@ public:
 
 public:
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    std::vector<Vector3f> vertices;
+    uint32_t numVertices;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
+    std::vector<uint32_t> vertexIndex;
+    std::vector<Vector2f> stCoordinates;
+    AliasTable triangleDistribution;//triangles by area, built for emissive meshes
 
     BVHAccel* bvh;
     float area;
@@ -312,7 +439,12 @@ public:
     Material *pMaterial;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+inline bool Triangle::intersect(const Ray& ray)
+{
+    float t = 0.0f, u = 0.0f, v = 0.0f;
+    return rayTriangleIntersect_MollerTrumbore(v0, e1, e2, ray.origin, ray.direction, t, u, v)
+        && t >= ray.t_min && t <= ray.t_max;
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
@@ -328,9 +460,9 @@ inline Intersection Triangle::getIntersection(Ray ray)
 
     float tempT = 0.0f;
     float u = 0.0f, v = 0.0f;
-    inter.happened = rayTriangleIntersect_MollerTrumbore(v0, v1, v2, ray.origin, ray.direction, tempT, u, v);
+    inter.happened = rayTriangleIntersect_MollerTrumbore(v0, e1, e2, ray.origin, ray.direction, tempT, u, v);
 
-    if (!inter.happened|| tempT<0.0f)
+    if (!inter.happened|| tempT<0.0f || tempT > ray.t_max)
     {
         return inter;
     }
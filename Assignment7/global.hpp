@@ -1,7 +1,8 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
+#include <cstdint>
+#include <limits>
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -28,13 +29,57 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
-inline float get_random_float()
+// PCG32 (pcg-random.org): 16 bytes of state and a handful of integer ops per number
+class Sampler
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+public:
+    Sampler(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t sequence = 0xda3e39cb94b95bdbULL)
+    {
+        setSeed(seed, sequence);
+    }
+
+    // same seed and sequence always give the same stream, different sequences give independent streams
+    void setSeed(uint64_t seed, uint64_t sequence = 0)
+    {
+        state = 0u;
+        inc = (sequence << 1u) | 1u;
+        nextUInt();
+        state += seed;
+        nextUInt();
+    }
+
+    uint32_t nextUInt()
+    {
+        uint64_t oldState = state;
+        state = oldState * 6364136223846793005ULL + inc;
+        uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rot = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+    }
+
+    // uniform in [0, 1), the top 24 bits fill the float mantissa exactly
+    float nextFloat() { return (nextUInt() >> 8) * (1.0f / 16777216.0f); }
+
+private:
+    uint64_t state, inc;
+};
 
-    return dist(rng);
+// every render thread owns one sampler, so drawing a number never locks or touches the OS entropy pool
+inline Sampler& get_thread_sampler()
+{
+    thread_local Sampler sampler;
+    return sampler;
+}
+
+// restart the calling thread's stream, e.g. per pixel so the image does not depend on the thread count
+inline void seed_random(uint64_t seed, uint64_t sequence)
+{
+    get_thread_sampler().setSeed(seed, sequence);
+}
+
+inline float get_random_float()
+{
+    return get_thread_sampler().nextFloat();
 }
 
 inline void UpdateProgress(float progress)
@@ -2,9 +2,14 @@
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Sphere.hpp"
+#include "Instance.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstdio>
+#include <functional>
+#include <cstdlib>
+#include <string>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -16,6 +21,55 @@ int main(int argc, char** argv)
     // Change the definition here to change resolution
     Scene scene(784, 784);
 
+    Renderer r;
+    int bunnyCount = 0;
+    int frameCount = 1;
+    float rebuildCostRatio = 1.5f;//see BVHAccel::refit
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--progressive")
+            r.progressive = true;
+        else if (option == "--light-bvh")
+            scene.useLightBVH = true;
+        else if (option == "--adaptive")
+            r.adaptive = true;
+        else if (option == "--min-spp" && hasValue)
+            r.minSpp = std::max(2, std::atoi(argv[++i]));
+        else if (option == "--error-threshold" && hasValue)
+            r.errorThreshold = (float)std::atof(argv[++i]);
+        else if (option == "--threads" && hasValue)
+            r.threadCount = std::atoi(argv[++i]);
+        else if (option == "--seed" && hasValue)
+            r.seed = (unsigned int)std::strtoul(argv[++i], nullptr, 10);
+        else if (option == "--spp" && hasValue)
+            r.spp = std::max(1, std::atoi(argv[++i]));
+        else if (option == "--time-budget" && hasValue)
+            r.timeBudget = std::atof(argv[++i]);
+        else if (option == "--preview-interval" && hasValue)
+            r.previewInterval = std::atof(argv[++i]);
+        else if (option == "--optimize-bvh" && hasValue)
+            scene.optimizeTimeBudget = std::atof(argv[++i]);
+        else if (option == "--compressed-nodes")
+            scene.compressedNodes = true;
+        else if (option == "--frames" && hasValue)
+            frameCount = std::max(1, std::atoi(argv[++i]));
+        else if (option == "--rebuild-ratio" && hasValue)
+            rebuildCostRatio = (float)std::atof(argv[++i]);
+        else if (option == "--bunnies" && hasValue)
+            bunnyCount = std::max(0, std::atoi(argv[++i]));
+        else if (option == "--split" && hasValue)
+        {
+            std::string method = argv[++i];
+            scene.splitMethod = method == "naive" ? BVHAccel::SplitMethod::NAIVE
+                : method == "lbvh" ? BVHAccel::SplitMethod::LBVH
+                : method == "hlbvh" ? BVHAccel::SplitMethod::HLBVH
+                : method == "sbvh" ? BVHAccel::SplitMethod::SBVH
+                : BVHAccel::SplitMethod::SAH;
+        }
+    }
+
     Material* red = new Material(DIFFUSE, Vector3f(0.0f));
     red->Kd = Vector3f(0.63f, 0.065f, 0.05f);
     Material* green = new Material(DIFFUSE, Vector3f(0.0f));
@@ -25,12 +79,12 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
 
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
+    MeshTriangle floor("../models/cornellbox/floor.obj", white, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
+    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
+    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
+    MeshTriangle left("../models/cornellbox/left.obj", red, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
+    MeshTriangle right("../models/cornellbox/right.obj", green, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
+    MeshTriangle light_("../models/cornellbox/light.obj", light, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget);
 
     scene.Add(&floor);
     scene.Add(&shortbox);
@@ -39,13 +93,83 @@ int main(int argc, char** argv)
     scene.Add(&right);
     scene.Add(&light_);
 
-    scene.buildBVH();
-    scene.calculateLightEmitArea();
+    // a grid of bunnies over the floor, all instances of one mesh
+    std::unique_ptr<MeshTriangle> bunny;//declared first so it outlives its instances
+    std::vector<std::unique_ptr<Instance>> bunnies;
+    std::vector<Vector3f> bunnyRest;
+    Vector3f bunnyBase;
+    std::function<Transform(int, int)> bunnyToWorld;//of bunny b in a frame
+    if (bunnyCount > 0)
+    {
+        bunny.reset(new MeshTriangle("../models/bunny/bunny.obj", white, scene.splitMethod, SIMD_WIDTH, scene.optimizeTimeBudget));
+        bunnyRest = bunny->vertices;
+        Bounds3 bunnyBounds = bunny->getBounds();
+        Vector3f bunnySize = bunnyBounds.Diagonal();
+        bunnyBase = Vector3f(0.5f * (bunnyBounds.pMin.x + bunnyBounds.pMax.x), bunnyBounds.pMin.y,
+                             0.5f * (bunnyBounds.pMin.z + bunnyBounds.pMax.z));
+        int columns = (int)std::ceil(std::sqrt((float)bunnyCount));
+        float cell = 550.0f / columns;
+        float scale = 0.8f * cell / std::max(bunnySize.x, bunnySize.z);
+        bunnyToWorld = [=](int b, int frame) {
+            // the grid circles the middle of the room, so the bunnies move across the scene BVH's boxes
+            Vector3f center(275.0f, 0.0f, 275.0f);
+            Vector3f position((b % columns + 0.5f) * cell, 0.0f, (b / columns + 0.5f) * cell);
+            return Transform::translate(center) * Transform::rotateY(30.0f * frame) * Transform::translate(position - center)
+                * Transform::rotateY(137.5f * b) * Transform::scale(Vector3f(scale)) * Transform::translate(-bunnyBase);
+        };
+        for (int b = 0; b < bunnyCount; ++b)
+        {
+            bunnies.push_back(std::unique_ptr<Instance>(new Instance(bunny.get(), bunnyToWorld(b, 0))));
+            scene.Add(bunnies.back().get());
+        }
+        std::cout << "Bunny instances: " << bunnyCount << ", " << (uint64_t)bunnyCount * bunny->numTriangles
+                  << " triangles sharing " << bunny->numTriangles << " stored ones\n";
+    }
 
-    Renderer r;
+    // the meshes' caches keep full nodes, they are compressed after loading
+    if (scene.compressedNodes)
+    {
+        for (MeshTriangle* mesh : { &floor, &shortbox, &tallbox, &left, &right, &light_, bunny.get() })
+        {
+            if (mesh)
+                mesh->bvh->compressNodes();
+        }
+    }
+    scene.buildBVH();
+    scene.buildLightDistribution();
 
+    // --frames animates the scene and refits it between frames: the bunny mesh sways and the instances
+    // circle the room, the light drifts sideways so its emitter data has to follow
+    std::vector<Vector3f> lightRest = light_.vertices;
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    for (int frame = 0; frame < frameCount; ++frame)
+    {
+        if (frame > 0)
+        {
+            float phase = 0.5f * frame;
+            for (size_t v = 0; v < lightRest.size(); ++v)
+            {
+                light_.vertices[v] = lightRest[v] + Vector3f(40.0f * std::sin(phase), 0.0f, 0.0f);
+            }
+            for (size_t v = 0; v < bunnyRest.size(); ++v)
+            {
+                float shear = 0.3f * std::sin(phase) * (bunnyRest[v].y - bunnyBase.y);
+                bunny->vertices[v] = bunnyRest[v] + Vector3f(shear, 0.0f, 0.0f);
+            }
+            for (size_t b = 0; b < bunnies.size(); ++b)
+            {
+                bunnies[b]->toWorld = bunnyToWorld((int)b, frame);
+            }
+            scene.refit(rebuildCostRatio);
+        }
+        r.Render(scene);
+        if (frameCount > 1)
+        {
+            std::string frameName = "frame" + std::to_string(frame) + ".ppm";
+            std::rename("binary.ppm", frameName.c_str());
+            std::cout << "\nWrote " << frameName << "\n";
+        }
+    }
     auto stop = std::chrono::system_clock::now();
 
     std::cout << "Render complete: \n";